@@ -13,6 +13,7 @@
  * (at your option) any later version.
  */
 
+#define _GNU_SOURCE
 #define _LARGEFILE_SOURCE
 #define _FILE_OFFSET_BITS 64
 
@@ -21,15 +22,41 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <time.h>
+#include <stddef.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <linux/fuse.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #if defined(__LITTLE_ENDIAN) && (__BYTE_ORDER == __LITTLE_ENDIAN)
 
 #define le32_to_cpu(x) (x)
+#define cpu_to_le32(x) (x)
+#define le16_to_cpu(x) (x)
 #define sle64_to_cpu(x) (x)
 #define cpu_to_sle64(x) (x)
 
@@ -61,12 +88,198 @@ static void perr_exit(const char *fmt, ...)
   exit(1);
 }
 
+#define DEFAULT_BUFFER_SIZE (8 << 20)
+#define MIN_BUFFER_SIZE     (1 << 17)
+#define MAP_RELEASE_STEP    (32 << 20)
+#define PASSTHROUGH_MIN     (1 << 18)
+#define PASSTHROUGH_MAX     MAP_RELEASE_STEP
+#define SAMPLE_RUN          1024
+
+static struct
+{
+  size_t buffer_size; /* size of the I/O buffer of each image file */
+  int no_mmap;        /* always use the buffer, even for regular files */
+  int threads;        /* number of comparison threads, 1 means no pipeline */
+  char* index;        /* compare against this index instead of OLDFILE */
+  int moves;          /* look for clusters moved within OLDFILE */
+  int dedup;          /* refer back to identical clusters within DELTA */
+  int compress;       /* zlib level for the payloads of DELTA, -1 for none */
+  int zeros;          /* write changed all-zero clusters as CMD_ZERO */
+  int64_t seek_step;  /* clusters per seek index entry of DELTA, 0 for none */
+  int raw;            /* patch to a raw volume instead of an image */
+  int direct;         /* write the raw volume with O_DIRECT */
+  char* device;       /* read NEWFILE from this NTFS volume instead */
+  char* changed;      /* list or bitmap of the clusters which may have changed */
+  int changed_bitmap;
+  int sectors;        /* write partly changed clusters as CMD_PATCH */
+  int stats;          /* print a summary at the end */
+  char* stats_json;   /* and write it to this file as JSON */
+  int progress;       /* print the progress every second */
+  int io_uring;       /* read and write the images through io_uring */
+  int checksums;      /* end DELTA with checksums of its blocks */
+  int64_t sample;     /* stat compares only one in this many runs of clusters */
+  char* ranges;       /* stat writes the changed ranges to this file */
+  size_t memory_limit; /* for the cluster buffers of the --threads pipeline, 0 for none */
+  char* resume;       /* checkpoint file of delta and patch */
+}
+opt = { DEFAULT_BUFFER_SIZE, 0, 1, NULL, 0, 0, -1, 0, 0, 0, 0, NULL, NULL, 0, 0, 0, NULL, 0, 0, 0, 0, NULL, 0, NULL };
+
+/*
+ * With --stats or --progress, the program keeps count of the bytes read
+ * from each input and written to the output, of the time spent waiting 
+ * in read and write calls and comparing clusters, summed up over all 
+ * threads, and of the commands written. Time spent on page faults of 
+ * mapped input images is not seen as reading, but where they happen.
+ */
+
+#define PROGRESS_CHECK 4096 /* clusters between looks at the clock */
+#define NSEC 1000000000LL
+
+struct file_stats
+{
+  char* name;
+  uint64_t bytes; /* only written by the thread reading the file */
+};
+
+static struct
+{
+  int enabled;
+  int64_t start;
+  int64_t read_ns;            /* updated atomically, from all threads */
+  int64_t write_ns;
+  int64_t compare_ns;
+  uint64_t out_bytes;
+  char* out_name;
+  struct file_stats** files;  /* the inputs */
+  int nfiles;
+  int64_t total;              /* clusters of the image being made */
+  int64_t done;
+  int64_t next_check;
+  int64_t last_print;
+}
+stats;
+
+static int64_t stats_clock()
+{
+  struct timespec ts;
+
+  if(!stats.enabled)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+static void stats_time(int64_t* counter, int64_t start)
+{
+  if(stats.enabled)
+    __atomic_add_fetch(counter, stats_clock() - start, __ATOMIC_RELAXED);
+}
+
+static void stats_written(size_t count)
+{
+  __atomic_add_fetch(&stats.out_bytes, count, __ATOMIC_RELAXED);
+}
+
+static struct file_stats* stats_file(char* name)
+{
+  struct file_stats* st;
+
+  if((st = calloc(1, sizeof(*st))) == NULL || 
+     (stats.files = realloc(stats.files, (stats.nfiles + 1) * sizeof(*stats.files))) == NULL)
+    perr_exit("failed to allocate statistics");
+  st->name = name;
+  stats.files[stats.nfiles++] = st;
+  return st;
+}
+
+
 static void read_all(int fd, void *buf, int count)
 {
+  int64_t t;
   int i;
   while(count > 0)
   {
+    t = stats_clock();
+    i = read(fd, buf, count);
+    stats_time(&stats.read_ns, t);
+    if(i < 0) 
+    {
+      if(errno != EAGAIN && errno != EINTR)
+        perr_exit("read");
+    }
+    else if(i == 0)
+    {
+      err_exit("read: unexpected end of file\n");
+    }
+    else 
+    {
+      count -= i;
+      buf = i + (char *) buf;
+    }
+  }
+}
+
+static size_t read_some(int fd, void *buf, size_t count)
+{
+  int64_t t;
+  ssize_t i;
+  for(;;)
+  {
+    t = stats_clock();
     i = read(fd, buf, count);
+    stats_time(&stats.read_ns, t);
+    if(i < 0) 
+    {
+      if(errno != EAGAIN && errno != EINTR)
+        perr_exit("read");
+    }
+    else if(i == 0)
+    {
+      err_exit("read: unexpected end of file\n");
+    }
+    else 
+    {
+      return i;
+    }
+  }
+}
+
+static void pread_all(int fd, void *buf, size_t count, off_t offset)
+{
+  int64_t t;
+  ssize_t i;
+  while(count > 0)
+  {
+    t = stats_clock();
+    i = pread(fd, buf, count, offset);
+    stats_time(&stats.read_ns, t);
+    if(i < 0) 
+    {
+      if(errno != EAGAIN && errno != EINTR)
+        perr_exit("read");
+    }
+    else if(i == 0)
+    {
+      err_exit("read: unexpected end of file\n");
+    }
+    else 
+    {
+      count -= i;
+      offset += i;
+      buf = i + (char *) buf;
+    }
+  }
+}
+
+static void preadv_all(int fd, struct iovec* iov, int count, off_t offset)
+{
+  int64_t t;
+  ssize_t i;
+  while(count > 0)
+  {
+    t = stats_clock();
+    i = preadv(fd, iov, count, offset);
+    stats_time(&stats.read_ns, t);
     if(i < 0) 
     {
       if(errno != EAGAIN && errno != EINTR)
@@ -78,7 +291,37 @@ static void read_all(int fd, void *buf, int count)
     }
     else 
     {
+      offset += i;
+      for(; count > 0 && (size_t)i >= iov->iov_len; iov++, count--)
+        i -= iov->iov_len;
+      if(count > 0)
+      {
+        iov->iov_base = i + (char *) iov->iov_base;
+        iov->iov_len -= i;
+      }
+    }
+  }
+}
+
+static void pwrite_all(int fd, void *buf, size_t count, off_t offset)
+{
+  int64_t t;
+  ssize_t i;
+  while(count > 0)
+  {
+    t = stats_clock();
+    i = pwrite(fd, buf, count, offset);
+    stats_time(&stats.write_ns, t);
+    if(i < 0) 
+    {
+      if(errno != EAGAIN && errno != EINTR)
+        perr_exit("write");
+    } 
+    else 
+    {
+      stats_written(i);
       count -= i;
+      offset += i;
       buf = i + (char *) buf;
     }
   }
@@ -86,10 +329,13 @@ static void read_all(int fd, void *buf, int count)
 
 static void write_all(int fd, void *buf, int count)
 {
+  int64_t t;
   int i;
   while(count > 0)
   {
+    t = stats_clock();
     i = write(fd, buf, count);
+    stats_time(&stats.write_ns, t);
     if(i < 0) 
     {
       if(errno != EAGAIN && errno != EINTR)
@@ -97,20 +343,261 @@ static void write_all(int fd, void *buf, int count)
     } 
     else 
     {
+      stats_written(i);
       count -= i;
       buf = i + (char *) buf;
     }
   }
 }
 
+/*
+ * With --io-uring, the images are read and written through an io_uring,
+ * set up with the plain system calls. Reads are issued well ahead of 
+ * where the input image is, and each buffer written is left in flight 
+ * while the next one is filled, so there are many requests on their way
+ * at once. That is what counts where each of them has a high latency, 
+ * like on a SAN. Where the kernel has no io_uring, or a request fails, 
+ * the blocking calls are used instead, which also report the errors.
+ */
+
+struct uring
+{
+  int fd;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+};
+
+/* returns -1 if the kernel does not allow io_uring */
+static int uring_setup(struct uring* u, unsigned entries)
+{
+  struct io_uring_params p;
+  size_t sq_len, cq_len;
+  char* sq, * cq;
+
+  memset(&p, 0, sizeof(p));
+  if((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return -1;
+
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP)                /* both rings in one mapping              */
+    sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+
+  sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq : 
+    mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, 
+    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if(sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED)
+  {
+    close(u->fd);
+    return -1;
+  }
+
+  u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned*)(sq + p.sq_off.array);
+  u->cq_head = (unsigned*)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+/* the caller never has more requests in flight than the ring has entries */
+static void uring_submit(struct uring* u, int op, int fd, void* buf, size_t count, off_t offset, uint64_t data)
+{
+  unsigned tail = *u->sq_tail, i = tail & *u->sq_mask;
+  struct io_uring_sqe* sqe = &u->sqes[i];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = count;
+  sqe->off = offset;
+  sqe->user_data = data;
+  u->sq_array[i] = i;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while(syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) < 0)
+  {
+    if(errno != EAGAIN && errno != EINTR && errno != EBUSY)
+      perr_exit("io_uring_enter");
+  }
+}
+
+/* waits for the next request to complete and returns its result */
+static int uring_wait(struct uring* u, uint64_t* data)
+{
+  unsigned head = *u->cq_head;
+  struct io_uring_cqe* cqe;
+  int res;
+
+  while(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+  {
+    if(syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+      perr_exit("io_uring_enter");
+  }
+
+  cqe = &u->cqes[head & *u->cq_mask];
+  *data = cqe->user_data;
+  res = cqe->res;
+  __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+  return res;
+}
+
+/*
+ * A pool of page-aligned buffers of the same size, carved from one arena
+ * allocated up front, so that nothing is allocated while they are passed
+ * around. A buffer has one owner at a time, which may hand it on to 
+ * another thread, and the last one puts it back. pool_get waits for that
+ * if all are in use, so the pool also caps the memory of its users.
+ */
+
+struct buffer_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t size;   /* of each buffer, rounded up to whole pages */
+  int count;
+  char* arena;
+  int* free;     /* stack of the numbers of the free buffers */
+  int nfree;
+};
+
+static struct buffer_pool* create_pool(size_t size, int count)
+{
+  struct buffer_pool* pool;
+  size_t page = sysconf(_SC_PAGESIZE);
+  int i;
+
+  if((pool = calloc(1, sizeof(*pool))) == NULL)
+    perr_exit("failed to allocate buffer pool");
+  pool->size = (size + page - 1) / page * page;
+  pool->count = count;
+  if(posix_memalign((void**)&pool->arena, page, pool->size * count) != 0 ||
+     (pool->free = malloc(count * sizeof(*pool->free))) == NULL)
+    perr_exit("failed to allocate buffer pool");
+  for(i = 0; i < count; i++)
+    pool->free[i] = count - 1 - i;                        /* the first buffer is handed out first   */
+  pool->nfree = count;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  return pool;
+}
+
+static void destroy_pool(struct buffer_pool* pool)
+{
+  if(!pool)
+    return;
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->arena);
+  free(pool->free);
+  free(pool);
+}
+
+static char* pool_get(struct buffer_pool* pool)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  while(pool->nfree == 0)
+    pthread_cond_wait(&pool->cond, &pool->lock);
+  i = pool->free[--pool->nfree];
+  pthread_mutex_unlock(&pool->lock);
+  return pool->arena + (size_t)i * pool->size;
+}
+
+static void pool_put(struct buffer_pool* pool, char* buf)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->free[pool->nfree++] = (buf - pool->arena) / pool->size;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
 #define CMD_SKIP 0
 #define CMD_DATA 1
 #define CMD_DROP 2
+#define CMD_COPY 3 /* followed by the number of a cluster of the old image */
+#define CMD_REF  4 /* followed by the number of an earlier payload of the delta */
+#define CMD_ZERO 5 /* followed by a repeat count, clusters which are all zero */
+#define CMD_PATCH 6 /* followed by a sector map, only the changed sectors as payload */
+
+#define DEDUP_WINDOW (64 << 20) /* CMD_REF only refers to this many bytes back */
 
 #define IMAGE_MAGIC "\0ntfsclone-image"
 #define DELTA_MAGIC "\0ntfsclone-delta"
+#define INDEX_MAGIC "\0ntfsclone-indx2"
+#define ZDELTA_MAGIC "\0ntfsclone-deltz"
+#define RDELTA_MAGIC "\0ntfsclone-deltr"  /* with CMD_REF, written with --dedup */
+#define ZRDELTA_MAGIC "\0ntfsclone-delzr" /* compressed and with CMD_REF */
+#define MDELTA_MAGIC "\0ntfsclone-deltm"   /* with CMD_COPY, written with --moves */
+#define ZMDELTA_MAGIC "\0ntfsclone-delzm"  /* and so on for the other kinds */
+#define RMDELTA_MAGIC "\0ntfsclone-delrm"
+#define ZRMDELTA_MAGIC "\0ntfsclone-dlzrm"
+#define SEEK_MAGIC "\0ntfsclone-dseek"
+#define CHECK_MAGIC "\0ntfsclone-dsums"
 #define IMAGE_MAGIC_SIZE  16
 
+/* the kinds of delta, by their magic */
+#define DELTA_COMPRESSED 1
+#define DELTA_REFS 2
+#define DELTA_MOVES 4
+
+static const char* delta_magics[8] = 
+{ 
+  DELTA_MAGIC, ZDELTA_MAGIC, RDELTA_MAGIC, ZRDELTA_MAGIC, 
+  MDELTA_MAGIC, ZMDELTA_MAGIC, RMDELTA_MAGIC, ZRMDELTA_MAGIC 
+};
+
+/* the DELTA_* flags of a delta magic, -1 if it is not one */
+static int delta_kind(const char* magic)
+{
+  int i;
+
+  for(i = 0; i < 8; i++)
+    if(memcmp(magic, delta_magics[i], IMAGE_MAGIC_SIZE) == 0)
+      return i;
+  return -1;
+}
+
+/* the magic of a delta written with the current options, moves if it may have CMD_COPY */
+static char* delta_magic(int moves)
+{
+  return (char*)delta_magics[(opt.compress >= 0 ? DELTA_COMPRESSED : 0) | (opt.dedup ? DELTA_REFS : 0) | (moves ? DELTA_MOVES : 0)];
+}
+
+/*
+ * A compressed delta (ZDELTA_MAGIC or ZRDELTA_MAGIC) is a series of 
+ * frames, each a frame_hdr, the command stream of the frame, in which 
+ * CMD_DATA is not followed by its payload, and then all payloads of the 
+ * frame compressed with zlib (or stored as they are, if zlen == 
+ * payload_len). Frames only end at command boundaries, and can be 
+ * decompressed independently.
+ */
+
+#define FRAME_BYTES (1 << 20)
+#define FRAME_MAX_BYTES (64 << 20)
+
+struct frame_hdr
+{
+  uint32_t cmd_len; /* all values are in little endian */
+  uint32_t payload_len;
+  uint32_t zlen;
+}
+__attribute__((__packed__));
+
+#define HASH_SIZE 32 /* an index has the BLAKE2b hash of each cluster as payload */
+
 struct image_hdr
 {
   char magic[IMAGE_MAGIC_SIZE];
@@ -128,6 +615,16 @@ __attribute__((__packed__));
 #define NTFSCLONE_IMG_VER_MINOR_OLD 0
 #define NTFSCLONE_IMG_VER_MINOR_NEW 1
 #define NTFS_MAX_CLUSTER_SIZE 65536
+#define NTFS_SECTOR_SIZE 512
+
+/* 
+ * CMD_PATCH changes some sectors of the cluster at the same position in
+ * the old image. Its sector map has a bit for each sector of a cluster, 
+ * the lowest bit of the first byte for the first sector, and the payload
+ * holds the sectors whose bits are set, in order.
+ */
+#define PATCH_MAP_SIZE(csize) (((csize) / NTFS_SECTOR_SIZE + 7) / 8)
+#define PATCH_MAP_MAX PATCH_MAP_SIZE(NTFS_MAX_CLUSTER_SIZE)
 
 struct input_image 
 {
@@ -136,284 +633,6154 @@ struct input_image
   char* hdr_extra;
   uint32_t hdr_extra_len;
   uint32_t csize;
+  uint32_t psize; /* size of the payload of a used cluster, csize or HASH_SIZE */
   int64_t ccount;
   int bbs_present; /* backup boot sector present after the last cluster */
   char cmd;
   int64_t cmd_repeat;
-  char cdata[NTFS_MAX_CLUSTER_SIZE];
+  int64_t cmd_arg; /* argument of the current CMD_COPY or CMD_REF */
+  char patch_map[PATCH_MAP_MAX]; /* of the current CMD_PATCH */
+  char* cdata; /* payload of the current cluster, valid until the next read */
+  char* cbuf;  /* csize bytes, for a payload which is not in buf in one piece */
+  char* buf; /* refill buffer, opt.buffer_size bytes */
+  size_t buf_pos;
+  size_t buf_len;
+  char* map; /* mapping of the whole file, used instead of buf if possible */
+  size_t map_size;
+  size_t map_pos;
+  size_t map_released; /* everything before this has been dropped again */
+  int keep_mapped;     /* pages are still needed after they have been read */
+  size_t data_start;   /* offset of the first command in the mapping */
+  struct cluster_locator* loc;
+  int refs;                  /* a delta which may have CMD_REF */
+  int moves;                 /* a delta which may have CMD_COPY */
+  struct payload_ring* ring; /* recent payloads of a delta, for CMD_REF */
+  struct frame_reader* zf;   /* current frame of a compressed delta */
+  struct device_source* dev; /* NTFS volume read through its $Bitmap */
+  struct uring_reader* ur;   /* reads in flight, with --io-uring */
+  struct checksums* sums;    /* of the bytes read, by verify */
+  struct file_stats* st;
 };
 
+#define COPY_WRITE 0 /* how pass-through spans get to the output file */
+#define COPY_RANGE 1
+#define COPY_SPLICE 2
+
 struct output_image
 {
   int fd;
   char cmd;
   int64_t cmd_repeat;
+  char* buf; /* write combining buffer, opt.buffer_size bytes */
+  size_t buf_len;
+  int copy_mode;
+  int seekable;               /* a named regular file or block device   */
+  struct payload_ring* ring;  /* recent payloads written, with --dedup  */
+  struct frame_writer* zf;    /* frames of a compressed delta           */
+  struct seek_index* seek;    /* trailer being collected, with --seek-index */
+  int64_t pos;                /* bytes written, except for compressed deltas */
+  int64_t clusters;           /* clusters covered by the commands written */
+  int64_t payloads;           /* CMD_DATA payloads written              */
+  int raw;                    /* only payloads, at their place on the volume */
+  int punch;                  /* unused clusters of a raw block device are discarded */
+  uint32_t csize;             /* of a raw volume                        */
+  off_t raw_offset;           /* where the buffer goes on a raw volume  */
+  struct uring_writer* uw;    /* writes in flight, with --io-uring      */
+  struct checksums* sums;     /* of the bytes written, with --checksums */
+  int discard;                /* only counted, for stat                 */
+  struct input_image* pt_src; /* pending span of clusters to pass through */
+  size_t pt_offset;           /* unchanged from a mapped input image    */
+  size_t pt_len;
 };
 
-static void open_input_image(char* file, struct input_image* img, char* magic)
-{
-  memset(img, 0, sizeof(*img));
+/*
+ * With --checksums, a delta ends with the crc32 of every CHECK_BLOCK bytes
+ * of the file before them, the last block being shorter, and then a 
+ * checksum_tail. verify keeps the same checksums of what it reads.
+ */
 
-  if(strcmp(file, "-") == 0) 
-  {
-    if((img->fd = fileno(stdin)) == -1)
-      err_exit("fileno for stdin failed");
-  } 
-  else 
-  {
-    if((img->fd = open(file, O_RDONLY)) == -1)
-      perr_exit("failed to open input image");
-  }
+#define CHECK_BLOCK (1 << 20)
 
-  read_all(img->fd, &img->hdr, ((size_t)&((struct image_hdr*)0)->offset_to_image_data));
+struct checksums
+{
+  int64_t pos;     /* bytes checksummed so far */
+  uint32_t crc;    /* of the current block */
+  uint32_t* crcs;  /* of the blocks done, in little endian */
+  int64_t count;
+  int64_t size;
+};
 
-  if(memcmp(img->hdr.magic, magic, IMAGE_MAGIC_SIZE) != 0)
-    err_exit("Input file doesn't have the expected magic header field!\n");
-  if(img->hdr.major_ver != NTFSCLONE_IMG_VER_MAJOR ||
-    (img->hdr.minor_ver != NTFSCLONE_IMG_VER_MINOR_OLD && img->hdr.minor_ver != NTFSCLONE_IMG_VER_MINOR_NEW))
-    err_exit("Image version %d.%d not supported\n", img->hdr.major_ver, img->hdr.minor_ver);
+static struct checksums* create_checksums()
+{
+  struct checksums* sums;
 
-  read_all(img->fd, &img->hdr.offset_to_image_data, sizeof(img->hdr.offset_to_image_data));
+  if((sums = calloc(1, sizeof(*sums))) == NULL)
+    perr_exit("failed to allocate checksums");
+  return sums;
+}
 
-  img->hdr_extra_len = le32_to_cpu(img->hdr.offset_to_image_data) - sizeof(img->hdr);
-    
-  if(img->hdr_extra_len > 0)
+static void end_checksum_block(struct checksums* sums)
+{
+  if(sums->count == sums->size)
   {
-    img->hdr_extra = malloc(img->hdr_extra_len);
-    read_all(img->fd, img->hdr_extra, img->hdr_extra_len);
+    sums->size = sums->size ? 2 * sums->size : 1024;
+    if((sums->crcs = realloc(sums->crcs, sums->size * sizeof(*sums->crcs))) == NULL)
+      perr_exit("failed to allocate checksums");
   }
-
-  img->csize = le32_to_cpu(img->hdr.cluster_size);
-  img->ccount = sle64_to_cpu(img->hdr.nr_clusters);
-  img->bbs_present = (img->hdr.minor_ver == NTFSCLONE_IMG_VER_MINOR_NEW) ? 1 : 0;
-  
-//fprintf(stderr, "Image opened for reading: %s %ld %lld -> %d\n", file, img->csize, img->ccount, img->fd); fflush(stderr);
+  sums->crcs[sums->count++] = cpu_to_le32(sums->crc);
+  sums->crc = 0;
 }
 
-static void create_output_image(char* file, struct output_image* img, char* magic, struct input_image* old_img)
+static void add_checksums(struct checksums* sums, const void* src, size_t count)
 {
-  memset(img, 0, sizeof(*img));
-  img->cmd = CMD_DATA;
+  const char* p = src;
+  size_t n;
 
-  if(strcmp(file, "-") == 0) 
-  {
-    if((img->fd = fileno(stdout)) == -1)
-      perr_exit("fileno for stdout failed");
-  }
-  else
+  while(count > 0)
   {
-    if((img->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
-      perr_exit("failed to open output image");
+    n = CHECK_BLOCK - sums->pos % CHECK_BLOCK;
+    if(n > count)
+      n = count;
+
+    sums->crc = crc32(sums->crc, (const Bytef*)p, n);
+    sums->pos += n;
+    p += n;
+    count -= n;
+
+    if(sums->pos % CHECK_BLOCK == 0)
+      end_checksum_block(sums);
   }
-  
-  write_all(img->fd, magic, IMAGE_MAGIC_SIZE);
-  write_all(img->fd, &old_img->hdr.major_ver, sizeof(old_img->hdr) - IMAGE_MAGIC_SIZE);
+}
 
-  if(old_img->hdr_extra_len)
-    write_all(img->fd, old_img->hdr_extra, old_img->hdr_extra_len);
-  
-//fprintf(stderr, "Image opened for writing: %s\n", file); fflush(stderr);
+/* the last block, which is shorter */
+static void finish_checksums(struct checksums* sums)
+{
+  if(sums->pos % CHECK_BLOCK != 0)
+    end_checksum_block(sums);
 }
 
-static void read_next_cluster(struct input_image* img, int allow_drop_cmd)
+static void check_mapped(struct input_image* img, size_t count)
 {
-  if(img->cmd_repeat > 0)
-    img->cmd_repeat--;
-  else 
+  if(count > img->map_size - img->map_pos)
+    err_exit("read: unexpected end of file\n");
+}
+
+static void release_mapped(struct input_image* img, size_t end)
+{
+  end &= ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+
+  if(end > img->map_released)
   {
-    read_all(img->fd, &img->cmd, sizeof(img->cmd));
-      
-    if(img->cmd == CMD_SKIP || (allow_drop_cmd && img->cmd == CMD_DROP))
-    {
-      read_all(img->fd, &img->cmd_repeat, sizeof(img->cmd_repeat));
+    madvise(img->map + img->map_released, end - img->map_released, MADV_DONTNEED);
+    posix_fadvise(img->fd, img->map_released, end - img->map_released, POSIX_FADV_DONTNEED);
+    img->map_released = end;
+  }
+}
 
-      img->cmd_repeat = sle64_to_cpu(img->cmd_repeat);
+/*
+ * With --from-device, NEWFILE is not an image but the NTFS volume itself.
+ * Its $Bitmap is read when it is opened, and then the volume is turned
+ * into the records of an image on the fly, whenever the buffer is 
+ * refilled: runs of unused clusters become CMD_SKIP, and runs of used 
+ * clusters are read in cluster order with one preadv each, straight into 
+ * the payloads of their CMD_DATA records. So nothing is read but the used 
+ * clusters, and the rest of the program does not notice the difference.
+ */
 
-      if(img->cmd_repeat == 0)
-        err_exit("Zero repeat length after command code in image\n");
+#define DEVICE_IOV_MAX 1024
 
-//fprintf(stderr, "<%d:%d:%lld>", img->fd, (int)img->cmd, img->cmd_repeat); 
+struct device_source
+{
+  unsigned char* bitmap; /* one bit for each cluster, set if in use */
+  int64_t next;          /* next cluster to be turned into a record */
+  int64_t device_size;
+  struct iovec iov[DEVICE_IOV_MAX];
+};
 
-      img->cmd_repeat--;
-    } 
-    else if(img->cmd == CMD_DATA) 
-      read_all(img->fd, img->cdata, img->csize);
-    else
-      err_exit("Invalid command code in image\n");
-  }
+static int cluster_in_use(unsigned char* bitmap, int64_t c)
+{
+  return (bitmap[c >> 3] >> (c & 7)) & 1;
 }
 
-static void write_pending_cmd(struct output_image* img)
+/* returns the number of clusters from c on, up to end, which are all in use or all unused */
+static int64_t bitmap_run(unsigned char* bitmap, int64_t c, int64_t end)
+{
+  int used = cluster_in_use(bitmap, c);
+  unsigned char same = used ? 0xff : 0;
+  int64_t i = c + 1;
+
+  while(i < end && (i & 7))
+  {
+    if(cluster_in_use(bitmap, i) != used)
+      return i - c;
+    i++;
+  }
+  while(i + 8 <= end && bitmap[i >> 3] == same)           /* whole bytes at once                    */
+    i += 8;
+  while(i < end && cluster_in_use(bitmap, i) == used)
+    i++;
+
+  return i - c;
+}
+
+/*
+ * With --changed or --changed-bitmap, the caller tells which clusters may
+ * have changed since OLDFILE, e.g. from the USN journal or from changed
+ * block tracking. All other clusters are taken as unchanged and passed 
+ * over in both images without looking at their payloads, and a device
+ * does not even read them. The backup boot sector is always compared.
+ */
+
+struct change_range
+{
+  int64_t first;
+  int64_t count;
+};
+
+static struct
+{
+  struct change_range* ranges; /* sorted, not overlapping */
+  int64_t count;
+  int64_t nclusters;
+}
+changes;
+
+static int compare_ranges(const void* a, const void* b)
+{
+  int64_t x = ((const struct change_range*)a)->first, y = ((const struct change_range*)b)->first;
+  return x < y ? -1 : x > y;
+}
+
+static void add_change(int64_t first, int64_t count, int64_t* size)
+{
+  if(changes.count == *size)
+  {
+    *size = *size ? 2 * *size : 1024;
+    if((changes.ranges = realloc(changes.ranges, *size * sizeof(*changes.ranges))) == NULL)
+      perr_exit("failed to allocate changed ranges");
+  }
+  changes.ranges[changes.count].first = first;
+  changes.ranges[changes.count].count = count;
+  changes.count++;
+}
+
+/* 
+ * reads the changed ranges of an image of nclusters, from a list with a
+ * line "FIRST COUNT" for each range, or from a bitmap with a bit for each
+ * cluster like $Bitmap, where the clusters beyond its end count as changed
+ */
+static void load_changes(char* file, int bitmap, int64_t nclusters)
+{
+  unsigned char* map;
+  char line[256], * p;
+  int64_t size = 0, first, count, n, i, j;
+  struct stat st;
+  FILE* f;
+  int fd;
+
+  if(bitmap)
+  {
+    if((fd = open(file, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+      perr_exit("failed to open changed cluster bitmap");
+    if((map = malloc(st.st_size + 1)) == NULL)
+      perr_exit("failed to allocate changed cluster bitmap");
+    read_all(fd, map, st.st_size);
+    close(fd);
+
+    n = (int64_t)st.st_size * 8 < nclusters ? (int64_t)st.st_size * 8 : nclusters;
+    for(i = 0; i < n; i += count)
+    {
+      count = bitmap_run(map, i, n);
+      if(cluster_in_use(map, i))
+        add_change(i, count, &size);
+    }
+    if(n < nclusters)
+      add_change(n, nclusters - n, &size);
+    free(map);
+  }
+  else
+  {
+    if((f = fopen(file, "r")) == NULL)
+      perr_exit("failed to open changed cluster list");
+    while(fgets(line, sizeof(line), f))
+    {
+      for(p = line; *p == ' ' || *p == '\t'; p++)
+        ;
+      if(*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+        continue;
+      if(sscanf(p, "%" SCNd64 " %" SCNd64, &first, &count) != 2 || first < 0 || count < 1)
+        err_exit("Invalid line in changed cluster list: %s", line);
+      if(first < nclusters)
+        add_change(first, count < nclusters - first ? count : nclusters - first, &size);
+    }
+    fclose(f);
+  }
+
+  qsort(changes.ranges, changes.count, sizeof(*changes.ranges), compare_ranges);
+  for(i = 0, j = 0; i < changes.count; i++)                /* merge overlapping and adjacent ranges */
+  {
+    if(j > 0 && changes.ranges[i].first <= changes.ranges[j - 1].first + changes.ranges[j - 1].count)
+    {
+      n = changes.ranges[i].first + changes.ranges[i].count - changes.ranges[j - 1].first;
+      if(n > changes.ranges[j - 1].count)
+        changes.ranges[j - 1].count = n;
+    }
+    else
+      changes.ranges[j++] = changes.ranges[i];
+  }
+  changes.count = j;
+  changes.nclusters = nclusters;
+  if(!changes.ranges)                                     /* nothing changed at all                 */
+    changes.ranges = malloc(sizeof(*changes.ranges));
+}
+
+/* with --sample, only the first SAMPLE_RUN of every clusters may have changed */
+static void sample_changes(int64_t every, int64_t nclusters)
+{
+  int64_t size = 0, first;
+
+  for(first = 0; first < nclusters; first += every * SAMPLE_RUN)
+    add_change(first, SAMPLE_RUN < nclusters - first ? SAMPLE_RUN : nclusters - first, &size);
+  changes.nclusters = nclusters;
+}
+
+/* 
+ * returns the number of clusters from pos on, up to max, which are all 
+ * hinted as changed or all not, and sets *changed accordingly 
+ */
+static int64_t hint_run(int64_t pos, int64_t max, int* changed)
+{
+  int64_t lo = 0, hi = changes.count, mid, n;
+
+  *changed = 1;
+  if(pos >= changes.nclusters)
+    return max;
+
+  while(lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if(changes.ranges[mid].first + changes.ranges[mid].count <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if(lo < changes.count && changes.ranges[lo].first <= pos)
+    n = changes.ranges[lo].first + changes.ranges[lo].count - pos;
+  else
+  {
+    *changed = 0;
+    n = (lo < changes.count ? changes.ranges[lo].first : changes.nclusters) - pos;
+  }
+
+  return n < max ? n : max;
+}
+
+static size_t read_device(struct input_image* img)
+{
+  struct device_source* dev = img->dev;
+  size_t rec = 1 + img->csize, len = 0;
+  int64_t n, i, repeat;
+  int used;
+  char* p;
+
+  while(dev->next < img->ccount && len + rec <= opt.buffer_size)
+  {
+    n = bitmap_run(dev->bitmap, dev->next, img->ccount);
+    used = cluster_in_use(dev->bitmap, dev->next);
+    if(used && changes.ranges)                            /* not looked at anyway if unchanged      */
+      n = hint_run(dev->next, n, &used);
+
+    if(!used)
+    {
+      img->buf[len] = CMD_SKIP;
+      repeat = cpu_to_sle64(n);
+      memcpy(img->buf + len + 1, &repeat, sizeof(repeat));
+      len += 1 + sizeof(repeat);
+      dev->next += n;
+      continue;
+    }
+
+    if(n > (int64_t)((opt.buffer_size - len) / rec))
+      n = (opt.buffer_size - len) / rec;
+    if(n > DEVICE_IOV_MAX)
+      n = DEVICE_IOV_MAX;
+
+    for(i = 0; i < n; i++)
+    {
+      p = img->buf + len + i * rec;
+      *p = CMD_DATA;
+      dev->iov[i].iov_base = p + 1;
+      dev->iov[i].iov_len = img->csize;
+    }
+    preadv_all(img->fd, dev->iov, n, dev->next * img->csize);
+    img->st->bytes += n * img->csize;
+    len += n * rec;
+    dev->next += n;
+  }
+
+  if(dev->next == img->ccount && img->bbs_present && len + rec <= opt.buffer_size)
+  {                                                       /* the backup boot sector in the last     */
+    img->buf[len] = CMD_DATA;                             /* sector of the device, like ntfsclone   */
+    memset(img->buf + len + 1, 0, img->csize);            /* stores it                              */
+    pread_all(img->fd, img->buf + len + 1, NTFS_SECTOR_SIZE, dev->device_size - NTFS_SECTOR_SIZE);
+    img->st->bytes += NTFS_SECTOR_SIZE;
+    len += rec;
+    dev->next++;
+  }
+
+  if(len == 0)
+    err_exit("read: unexpected end of file\n");
+
+  return len;
+}
+
+/*
+ * An input image read through io_uring has its buffer split into slots 
+ * which are all being read at once. The image is read from the slots in 
+ * turn, and each slot is sent off for the next part of the file as soon 
+ * as the image has moved on to the slot after it.
+ */
+
+#define URING_READ_SIZE (1 << 20)
+#define URING_DEPTH_MAX 64
+
+struct uring_reader
+{
+  struct uring ring;
+  int depth;
+  size_t slot_size;
+  char* slots[URING_DEPTH_MAX];
+  off_t offset[URING_DEPTH_MAX];
+  ssize_t len[URING_DEPTH_MAX];  /* bytes read, -1 while in flight */
+  int head;                      /* the slot to be read next */
+  int started;                   /* the slot before head is done with */
+  off_t next;                    /* where the next slot is read from */
+};
+
+static void submit_read(struct input_image* img, int i)
+{
+  struct uring_reader* ur = img->ur;
+
+  ur->offset[i] = ur->next;
+  ur->len[i] = -1;
+  uring_submit(&ur->ring, IORING_OP_READ, img->fd, ur->slots[i], ur->slot_size, ur->next, i);
+  ur->next += ur->slot_size;
+}
+
+/* only possible for regular files and block devices */
+static void start_uring_input(struct input_image* img)
+{
+  struct uring_reader* ur;
+  struct stat st;
+  off_t start;
+  int i;
+
+  if(fstat(img->fd, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) || 
+     (start = lseek(img->fd, 0, SEEK_CUR)) == (off_t)-1)
+    return;
+
+  if((ur = calloc(1, sizeof(*ur))) == NULL)
+    perr_exit("failed to allocate io_uring reader");
+  ur->slot_size = opt.buffer_size / 2 < URING_READ_SIZE ? opt.buffer_size / 2 : URING_READ_SIZE;
+  ur->depth = opt.buffer_size / ur->slot_size;
+  if(ur->depth > URING_DEPTH_MAX)
+    ur->depth = URING_DEPTH_MAX;
+
+  if(uring_setup(&ur->ring, ur->depth) == -1)
+  {
+    free(ur);
+    return;
+  }
+  if((ur->slots[0] = malloc(ur->depth * ur->slot_size)) == NULL)
+    perr_exit("failed to allocate input buffer");
+
+  img->ur = ur;
+  ur->next = start;
+  for(i = 0; i < ur->depth; i++)
+  {
+    ur->slots[i] = ur->slots[0] + i * ur->slot_size;
+    submit_read(img, i);
+  }
+}
+
+/* returns 0 at the end of the file */
+static size_t read_uring(struct input_image* img)
+{
+  struct uring_reader* ur = img->ur;
+  int64_t t = stats_clock();
+  int i = ur->head, res;
+  ssize_t n;
+  uint64_t c;
+
+  if(ur->started)                                         /* what the image has just left behind    */
+    submit_read(img, (i + ur->depth - 1) % ur->depth);
+  ur->started = 1;
+
+  while(ur->len[i] < 0)
+  {
+    res = uring_wait(&ur->ring, &c);
+    for(ur->len[c] = res > 0 ? res : 0; (size_t)ur->len[c] < ur->slot_size; ur->len[c] += n)
+    {                                                     /* short or failed, finish it the usual   */
+      n = pread(img->fd, ur->slots[c] + ur->len[c], ur->slot_size - ur->len[c], ur->offset[c] + ur->len[c]);
+      if(n == 0)                                          /* way, up to the end of the file         */
+        break;
+      if(n < 0 && errno != EAGAIN && errno != EINTR)
+        perr_exit("read");
+      if(n < 0)
+        n = 0;
+    }
+  }
+  stats_time(&stats.read_ns, t);
+
+  ur->head = (i + 1) % ur->depth;
+  img->buf = ur->slots[i];
+  return ur->len[i];
+}
+
+static void refill_input(struct input_image* img)
+{
+  if(img->dev)
+    img->buf_len = read_device(img);
+  else if(img->ur)
+  {
+    if((img->buf_len = read_uring(img)) == 0)
+      err_exit("read: unexpected end of file\n");
+    img->st->bytes += img->buf_len;
+  }
+  else
+  {
+    img->buf_len = read_some(img->fd, img->buf, opt.buffer_size);
+    img->st->bytes += img->buf_len;
+  }
+  img->buf_pos = 0;
+}
+
+static void read_input(struct input_image* img, void* dst, size_t count)
+{
+  size_t n;
+
+  if(img->map)
+  {
+    check_mapped(img, count);
+    if(img->sums)
+      add_checksums(img->sums, img->map + img->map_pos, count);
+    memcpy(dst, img->map + img->map_pos, count);
+    img->map_pos += count;
+    img->st->bytes += count;
+    return;
+  }
+
+  while(count > 0)
+  {
+    if(img->buf_pos == img->buf_len)
+    {
+      if(count >= opt.buffer_size && !img->dev && !img->ur) /* nothing to gain from buffering this  */
+      {
+        read_all(img->fd, dst, count);
+        img->st->bytes += count;
+        if(img->sums)
+          add_checksums(img->sums, dst, count);
+        return;
+      }
+      refill_input(img);
+    }
+
+    n = img->buf_len - img->buf_pos;
+    if(n > count)
+      n = count;
+
+    if(img->sums)
+      add_checksums(img->sums, img->buf + img->buf_pos, n);
+    memcpy(dst, img->buf + img->buf_pos, n);
+    img->buf_pos += n;
+    dst = n + (char *) dst;
+    count -= n;
+  }
+}
+
+static void skip_input(struct input_image* img, size_t count)
+{
+  size_t n;
+
+  if(img->map)                                            /* not even touching the pages, unless    */
+  {
+    check_mapped(img, count);                             /* verifying                              */
+    if(img->sums)
+    {
+      add_checksums(img->sums, img->map + img->map_pos, count);
+      img->st->bytes += count;
+    }
+    img->map_pos += count;
+    return;
+  }
+
+  while(count > 0)
+  {
+    if(img->buf_pos == img->buf_len)
+    {
+      refill_input(img);
+    }
+
+    n = img->buf_len - img->buf_pos;
+    if(n > count)
+      n = count;
+
+    if(img->sums)
+      add_checksums(img->sums, img->buf + img->buf_pos, n);
+    img->buf_pos += n;
+    count -= n;
+  }
+}
+
+/* like read_input, but avoids the copy where possible */
+static char* read_input_ptr(struct input_image* img, size_t count)
+{
+  char* p;
+
+  if(img->map)
+  {
+    check_mapped(img, count);
+    if(!img->keep_mapped && img->map_pos - img->map_released >= MAP_RELEASE_STEP)
+      release_mapped(img, img->map_pos);
+    p = img->map + img->map_pos;
+    img->map_pos += count;
+    img->st->bytes += count;
+    if(img->sums)
+      add_checksums(img->sums, p, count);
+    return p;
+  }
+
+  if(img->buf_len - img->buf_pos >= count)
+  {
+    p = img->buf + img->buf_pos;
+    img->buf_pos += count;
+    if(img->sums)
+      add_checksums(img->sums, p, count);
+    return p;
+  }
+
+  if(!img->cbuf && posix_memalign((void**)&img->cbuf, sysconf(_SC_PAGESIZE), img->csize) != 0)
+    perr_exit("failed to allocate cluster buffer");
+  read_input(img, img->cbuf, count);
+  return img->cbuf;
+}
+
+struct frame_reader
+{
+  char* cmd;
+  size_t cmd_len;
+  size_t cmd_pos;
+  char* payload;
+  size_t payload_len;
+  size_t payload_pos;
+  char* zbuf;
+  size_t cmd_size;   /* allocated sizes of the buffers */
+  size_t payload_size;
+  size_t zbuf_size;
+};
+
+static void grow_buffer(char** buf, size_t* size, size_t needed)
+{
+  if(needed > *size)
+  {
+    free(*buf);
+    if((*buf = malloc(needed)) == NULL)
+      perr_exit("failed to allocate frame buffer");
+    *size = needed;
+  }
+}
+
+static void read_frame(struct input_image* img)
+{
+  struct frame_reader* zf = img->zf;
+  struct frame_hdr fh;
+  uLongf len;
+  char* z;
+
+  read_input(img, &fh, sizeof(fh));
+  zf->cmd_len = le32_to_cpu(fh.cmd_len);
+  zf->payload_len = le32_to_cpu(fh.payload_len);
+  fh.zlen = le32_to_cpu(fh.zlen);
+  if(zf->cmd_len == 0 || zf->cmd_len > FRAME_MAX_BYTES || zf->payload_len > FRAME_MAX_BYTES || fh.zlen > FRAME_MAX_BYTES)
+    err_exit("Invalid frame in compressed delta\n");
+
+  grow_buffer(&zf->cmd, &zf->cmd_size, zf->cmd_len);
+  read_input(img, zf->cmd, zf->cmd_len);
+  zf->cmd_pos = 0;
+  zf->payload_pos = 0;
+
+  if(img->map)
+    z = read_input_ptr(img, fh.zlen);
+  else
+  {
+    grow_buffer(&zf->zbuf, &zf->zbuf_size, fh.zlen);
+    read_input(img, zf->zbuf, fh.zlen);
+    z = zf->zbuf;
+  }
+
+  grow_buffer(&zf->payload, &zf->payload_size, zf->payload_len);
+  if(fh.zlen == zf->payload_len)
+    memcpy(zf->payload, z, fh.zlen);
+  else if(uncompress((Bytef*)zf->payload, (len = zf->payload_len, &len), (Bytef*)z, fh.zlen) != Z_OK || len != zf->payload_len)
+    err_exit("Corrupt frame in compressed delta\n");
+}
+
+/* reads command codes and their arguments, from the current frame if compressed */
+static void read_cmd_input(struct input_image* img, void* dst, size_t count)
+{
+  struct frame_reader* zf = img->zf;
+
+  if(!zf)
+  {
+    read_input(img, dst, count);
+    return;
+  }
+
+  if(zf->cmd_pos == zf->cmd_len)
+    read_frame(img);
+  if(count > zf->cmd_len - zf->cmd_pos)
+    err_exit("Invalid frame in compressed delta\n");
+
+  memcpy(dst, zf->cmd + zf->cmd_pos, count);
+  zf->cmd_pos += count;
+}
+
+/* like read_input_ptr, for payloads */
+static char* read_payload_ptr(struct input_image* img, size_t count)
+{
+  struct frame_reader* zf = img->zf;
+  char* p;
+
+  if(!zf)
+    return read_input_ptr(img, count);
+
+  if(count > zf->payload_len - zf->payload_pos)
+    err_exit("Invalid frame in compressed delta\n");
+
+  p = zf->payload + zf->payload_pos;
+  zf->payload_pos += count;
+  return p;
+}
+
+static void skip_payload(struct input_image* img, size_t count)
+{
+  if(img->zf)
+    read_payload_ptr(img, count);
+  else
+    skip_input(img, count);
+}
+
+/* whether payload pointers point into the mapping of the file and stay valid */
+static int payload_mapped(struct input_image* img)
+{
+  return img->map && !img->zf;
+}
+
+static void map_input_image(struct input_image* img)
+{
+  struct stat st;
+  void* map;
+
+  if(fstat(img->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (uint64_t)st.st_size > SIZE_MAX)
+    return;
+  
+  if((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, img->fd, 0)) == MAP_FAILED)
+    return;
+
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  img->map = map;
+  img->map_size = st.st_size;
+}
+
+static void open_input_image(char* file, struct input_image* img, char* magic)
+{
+  int kind;
+
+  memset(img, 0, sizeof(*img));
+  img->st = stats_file(file);
+
+  if(strcmp(file, "-") == 0) 
+  {
+    if((img->fd = fileno(stdin)) == -1)
+      err_exit("fileno for stdin failed");
+  } 
+  else 
+  {
+    if((img->fd = open(file, O_RDONLY)) == -1)
+      perr_exit("failed to open input image");
+
+    if(!opt.no_mmap)
+      map_input_image(img);
+  }
+
+  if(!img->map && opt.io_uring)
+    start_uring_input(img);
+  if(!img->map && !img->ur && (img->buf = malloc(opt.buffer_size)) == NULL)
+    perr_exit("failed to allocate input buffer");
+
+  read_input(img, &img->hdr, ((size_t)&((struct image_hdr*)0)->offset_to_image_data));
+
+  if(memcmp(magic, DELTA_MAGIC, IMAGE_MAGIC_SIZE) == 0 && (kind = delta_kind(img->hdr.magic)) >= 0)
+  {
+    if((kind & DELTA_COMPRESSED) && (img->zf = calloc(1, sizeof(*img->zf))) == NULL)
+      perr_exit("failed to allocate frame reader");
+    img->refs = (kind & DELTA_REFS) != 0;
+    img->moves = (kind & DELTA_MOVES) != 0;
+  }
+  else if(memcmp(img->hdr.magic, magic, IMAGE_MAGIC_SIZE) != 0)
+    err_exit("Input file doesn't have the expected magic header field!\n");
+  if(img->hdr.major_ver != NTFSCLONE_IMG_VER_MAJOR ||
+    (img->hdr.minor_ver != NTFSCLONE_IMG_VER_MINOR_OLD && img->hdr.minor_ver != NTFSCLONE_IMG_VER_MINOR_NEW))
+    err_exit("Image version %d.%d not supported\n", img->hdr.major_ver, img->hdr.minor_ver);
+
+  read_input(img, &img->hdr.offset_to_image_data, sizeof(img->hdr.offset_to_image_data));
+
+  img->hdr_extra_len = le32_to_cpu(img->hdr.offset_to_image_data) - sizeof(img->hdr);
+    
+  if(img->hdr_extra_len > 0)
+  {
+    img->hdr_extra = malloc(img->hdr_extra_len);
+    read_input(img, img->hdr_extra, img->hdr_extra_len);
+  }
+
+  img->csize = le32_to_cpu(img->hdr.cluster_size);
+  img->psize = memcmp(magic, INDEX_MAGIC, IMAGE_MAGIC_SIZE) == 0 ? HASH_SIZE : img->csize;
+  img->ccount = sle64_to_cpu(img->hdr.nr_clusters);
+  img->bbs_present = (img->hdr.minor_ver == NTFSCLONE_IMG_VER_MINOR_NEW) ? 1 : 0;
+  img->data_start = img->map_pos;
+  
+//fprintf(stderr, "Image opened for reading: %s %ld %lld -> %d\n", file, img->csize, img->ccount, img->fd); fflush(stderr);
+}
+
+/* the parts of the NTFS on-disk structures needed to find $Bitmap */
+
+struct ntfs_boot_sector
+{
+  char jump[3];
+  char oem_id[8];             /* "NTFS    " */
+  uint16_t bytes_per_sector;  /* all values are in little endian */
+  uint8_t sectors_per_cluster;
+  char unused[26];
+  int64_t total_sectors;
+  int64_t mft_lcn;
+  int64_t mftmirr_lcn;
+  int8_t clusters_per_mft_record; /* or 2^-x bytes if negative */
+}
+__attribute__((__packed__));
+
+struct ntfs_mft_record
+{
+  char magic[4];              /* "FILE" */
+  uint16_t usa_ofs;           /* update sequence array, for the fixups */
+  uint16_t usa_count;
+  int64_t lsn;
+  uint16_t sequence_number;
+  uint16_t link_count;
+  uint16_t attrs_offset;
+}
+__attribute__((__packed__));
+
+struct ntfs_attr
+{
+  uint32_t type;
+  uint32_t length;
+  uint8_t non_resident;
+  uint8_t name_length;
+  uint16_t name_offset;
+  uint16_t flags;
+  uint16_t instance;
+  union
+  {
+    struct
+    {
+      uint32_t value_length;
+      uint16_t value_offset;
+    }
+    __attribute__((__packed__)) r;
+    struct
+    {
+      int64_t lowest_vcn;
+      int64_t highest_vcn;
+      uint16_t mapping_pairs_offset;
+      uint8_t compression_unit;
+      char reserved[5];
+      int64_t allocated_size;
+      int64_t data_size;
+    }
+    __attribute__((__packed__)) nr;
+  };
+}
+__attribute__((__packed__));
+
+#define NTFS_FILE_BITMAP 6
+#define NTFS_AT_DATA 0x80
+#define NTFS_AT_END 0xffffffff
+#define NTFS_ATTR_COMPRESSED 0x0001
+
+/* applies the fixups of a multi sector record */
+static void fixup_record(char* rec, uint32_t size)
+{
+  struct ntfs_mft_record* m = (struct ntfs_mft_record*)rec;
+  uint32_t ofs = le16_to_cpu(m->usa_ofs), count = le16_to_cpu(m->usa_count), i;
+
+  if(count == 0 || ofs + 2 * count > size || (count - 1) * NTFS_SECTOR_SIZE > size)
+    err_exit("Invalid MFT record of $Bitmap\n");
+
+  for(i = 1; i < count; i++)
+  {
+    if(memcmp(rec + i * NTFS_SECTOR_SIZE - 2, rec + ofs, 2) != 0)
+      err_exit("Invalid MFT record of $Bitmap\n");
+    memcpy(rec + i * NTFS_SECTOR_SIZE - 2, rec + ofs + 2 * i, 2);
+  }
+}
+
+/* reads the clusters of a non-resident attribute, following its mapping pairs */
+static void read_runlist(int fd, uint32_t csize, char* pairs, char* end, char* dst, int64_t size)
+{
+  int64_t vcn = 0, lcn = 0, len, delta, n;
+  int i, len_size, ofs_size;
+
+  while(pairs < end && *pairs != 0 && vcn * csize < size)
+  {
+    len_size = *pairs & 0x0f;
+    ofs_size = (*pairs >> 4) & 0x0f;
+    if(len_size == 0 || len_size > 8 || ofs_size > 8 || pairs + 1 + len_size + ofs_size > end)
+      err_exit("Invalid mapping pairs of $Bitmap\n");
+
+    for(len = 0, i = len_size; i > 0; i--)
+      len = (len << 8) | (unsigned char)pairs[i];
+    for(delta = ofs_size ? (signed char)pairs[len_size + ofs_size] : 0, i = len_size + ofs_size - 1; i > len_size; i--)
+      delta = (delta << 8) | (unsigned char)pairs[i];
+    pairs += 1 + len_size + ofs_size;
+
+    n = len * csize < size - vcn * csize ? len * csize : size - vcn * csize;
+    if(ofs_size == 0)                                     /* sparse, stays zero                     */
+      memset(dst + vcn * csize, 0, n);
+    else
+    {
+      lcn += delta;
+      pread_all(fd, dst + vcn * csize, n, lcn * csize);
+    }
+    vcn += len;
+  }
+
+  if(vcn * csize < size)
+    err_exit("Mapping pairs of $Bitmap are too short\n");
+}
+
+/* 
+ * opens an NTFS volume as if it were an image with the header of old, 
+ * which must be an image of the same volume
+ */
+static void open_device_image(char* file, struct input_image* img, struct input_image* old)
+{
+  struct device_source* dev;
+  struct ntfs_boot_sector bs;
+  struct ntfs_mft_record* m;
+  struct ntfs_attr* a;
+  uint64_t size;
+  uint32_t rsize, spc;
+  int64_t bsize, inuse, i;
+  char* rec, * p;
+  struct stat st;
+
+  memset(img, 0, sizeof(*img));
+  img->st = stats_file(file);
+
+  if((img->fd = open(file, O_RDONLY)) == -1)
+    perr_exit("failed to open device");
+  if(fstat(img->fd, &st) == -1)
+    perr_exit("fstat");
+  if(S_ISBLK(st.st_mode))
+  {
+    if(ioctl(img->fd, BLKGETSIZE64, &size) == -1)
+      perr_exit("BLKGETSIZE64");
+  }
+  else
+    size = st.st_size;
+  posix_fadvise(img->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  pread_all(img->fd, &bs, sizeof(bs), 0);
+  if(memcmp(bs.oem_id, "NTFS    ", sizeof(bs.oem_id)) != 0)
+    err_exit("%s is not an NTFS volume\n", file);
+
+  spc = bs.sectors_per_cluster > 0x80 ? 1U << (256 - bs.sectors_per_cluster) : bs.sectors_per_cluster;
+  img->csize = le16_to_cpu(bs.bytes_per_sector) * spc;
+  if(spc == 0 || img->csize < NTFS_SECTOR_SIZE || img->csize > NTFS_MAX_CLUSTER_SIZE)
+    err_exit("%s has an unsupported cluster size\n", file);
+  img->psize = img->csize;
+  img->ccount = sle64_to_cpu(bs.total_sectors) / spc;
+  rsize = bs.clusters_per_mft_record > 0 ? bs.clusters_per_mft_record * img->csize : 1U << -bs.clusters_per_mft_record;
+  if(rsize < sizeof(*m) || rsize > NTFS_MAX_CLUSTER_SIZE)
+    err_exit("%s has an unsupported MFT record size\n", file);
+
+  if((rec = malloc(rsize)) == NULL)                       /* the first records of $MFT are always   */
+    perr_exit("failed to allocate MFT record");           /* where the boot sector says             */
+  pread_all(img->fd, rec, rsize, sle64_to_cpu(bs.mft_lcn) * img->csize + NTFS_FILE_BITMAP * rsize);
+  m = (struct ntfs_mft_record*)rec;
+  if(memcmp(m->magic, "FILE", sizeof(m->magic)) != 0)
+    err_exit("Invalid MFT record of $Bitmap\n");
+  fixup_record(rec, rsize);
+
+  if((dev = calloc(1, sizeof(*dev))) == NULL)
+    perr_exit("failed to allocate device source");
+  bsize = (img->ccount + 7) / 8;
+  if((dev->bitmap = malloc(bsize)) == NULL)
+    perr_exit("failed to allocate cluster bitmap");
+
+  for(p = rec + le16_to_cpu(m->attrs_offset); ; p += le32_to_cpu(a->length))
+  {
+    a = (struct ntfs_attr*)p;
+    if(p + sizeof(a->type) > rec + rsize || le32_to_cpu(a->type) == NTFS_AT_END)
+      err_exit("No $DATA attribute in the MFT record of $Bitmap\n");
+    if(le32_to_cpu(a->length) < offsetof(struct ntfs_attr, r) || p + le32_to_cpu(a->length) > rec + rsize)
+      err_exit("Invalid MFT record of $Bitmap\n");
+    if(le32_to_cpu(a->type) == NTFS_AT_DATA && a->name_length == 0)
+      break;
+  }
+
+  if(a->non_resident)
+  {
+    if(le16_to_cpu(a->flags) & NTFS_ATTR_COMPRESSED || sle64_to_cpu(a->nr.data_size) < bsize)
+      err_exit("Unsupported $DATA attribute of $Bitmap\n");
+    read_runlist(img->fd, img->csize, p + le16_to_cpu(a->nr.mapping_pairs_offset), p + le32_to_cpu(a->length), (char*)dev->bitmap, bsize);
+  }
+  else
+  {
+    if(le32_to_cpu(a->r.value_length) < bsize || le16_to_cpu(a->r.value_offset) + bsize > le32_to_cpu(a->length))
+      err_exit("Unsupported $DATA attribute of $Bitmap\n");
+    memcpy(dev->bitmap, p + le16_to_cpu(a->r.value_offset), bsize);
+  }
+  free(rec);
+
+  for(inuse = 0, i = 0; i < img->ccount; i++)
+    inuse += cluster_in_use(dev->bitmap, i);
+  dev->device_size = size;
+
+  img->hdr = old->hdr;                                    /* what ntfsclone would have written      */
+  memcpy(img->hdr.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+  img->hdr.cluster_size = cpu_to_le32(img->csize);
+  img->hdr.device_size = cpu_to_sle64(size);
+  img->hdr.nr_clusters = cpu_to_sle64(img->ccount);
+  img->hdr.inuse = cpu_to_sle64(inuse);
+  img->hdr_extra = old->hdr_extra;
+  img->hdr_extra_len = old->hdr_extra_len;
+  img->bbs_present = old->bbs_present;
+  if(img->bbs_present && size < (uint64_t)img->ccount * img->csize + NTFS_SECTOR_SIZE)
+    err_exit("%s has no backup boot sector\n", file);
+
+  if((img->buf = malloc(opt.buffer_size)) == NULL)
+    perr_exit("failed to allocate input buffer");
+  img->dev = dev;
+}
+
+/*
+ * An output image written through io_uring has a few buffers, and the 
+ * full one is sent off while the next one is filled. Its writes are at
+ * offsets of their own, so before anything else writes to the file, all
+ * of them are waited for and the file position is set after them.
+ */
+
+#define URING_WRITE_BUFS 4
+
+struct uring_writer
+{
+  struct uring ring;
+  char* bufs[URING_WRITE_BUFS];
+  off_t offset[URING_WRITE_BUFS];
+  size_t len[URING_WRITE_BUFS]; /* in flight, 0 if free */
+  int cur;                      /* the one being filled */
+  off_t next;                   /* where the next write goes */
+  int synced;                   /* next has to be taken from the file position */
+};
+
+/* for regular files and block devices, img->buf is the first buffer */
+static void start_uring_output(struct output_image* img)
+{
+  struct uring_writer* uw;
+  int i;
+
+  if((uw = calloc(1, sizeof(*uw))) == NULL)
+    perr_exit("failed to allocate io_uring writer");
+  if(uring_setup(&uw->ring, URING_WRITE_BUFS) == -1)
+  {
+    free(uw);
+    return;
+  }
+
+  uw->bufs[0] = img->buf;
+  for(i = 1; i < URING_WRITE_BUFS; i++)
+    if(posix_memalign((void**)&uw->bufs[i], 4096, opt.buffer_size) != 0)
+      perr_exit("failed to allocate output buffer");
+  uw->synced = 1;
+  img->uw = uw;
+}
+
+static void complete_write(struct output_image* img)
+{
+  struct uring_writer* uw = img->uw;
+  int64_t t = stats_clock();
+  int res;
+  uint64_t i;
+
+  res = uring_wait(&uw->ring, &i);
+  stats_time(&stats.write_ns, t);
+
+  if(res > 0)
+    stats_written(res);
+  else
+    res = 0;
+  if((size_t)res < uw->len[i])                            /* short or failed, the rest is written   */
+    pwrite_all(img->fd, uw->bufs[i] + res, uw->len[i] - res, uw->offset[i] + res); /* the usual way */
+  uw->len[i] = 0;
+}
+
+static void write_uring(struct output_image* img)
+{
+  struct uring_writer* uw = img->uw;
+  int i = uw->cur;
+
+  if(img->raw)
+  {
+    uw->offset[i] = img->raw_offset;
+    img->raw_offset += img->buf_len;
+  }
+  else
+  {
+    if(uw->synced && (uw->next = lseek(img->fd, 0, SEEK_CUR)) == (off_t)-1)
+      perr_exit("lseek");
+    uw->synced = 0;
+    uw->offset[i] = uw->next;
+    uw->next += img->buf_len;
+  }
+
+  uw->len[i] = img->buf_len;
+  uring_submit(&uw->ring, IORING_OP_WRITE, img->fd, uw->bufs[i], img->buf_len, uw->offset[i], i);
+
+  uw->cur = (i + 1) % URING_WRITE_BUFS;
+  while(uw->len[uw->cur] > 0)
+    complete_write(img);
+  img->buf = uw->bufs[uw->cur];
+}
+
+/* waits for all writes in flight, before the file is written to otherwise */
+static void drain_output(struct output_image* img)
+{
+  struct uring_writer* uw = img->uw;
+  int i;
+
+  if(!uw)
+    return;
+
+  for(i = 0; i < URING_WRITE_BUFS; i++)
+    while(uw->len[i] > 0)
+      complete_write(img);
+
+  if(!img->raw && !uw->synced)
+  {
+    if(lseek(img->fd, uw->next, SEEK_SET) == (off_t)-1)
+      perr_exit("lseek");
+    uw->synced = 1;
+  }
+}
+
+static void flush_buffer(struct output_image* img)
+{
+  if(img->buf_len > 0)
+  {
+    if(img->uw)
+      write_uring(img);
+    else if(img->raw)
+    {
+      pwrite_all(img->fd, img->buf, img->buf_len, img->raw_offset);
+      img->raw_offset += img->buf_len;
+    }
+    else
+      write_all(img->fd, img->buf, img->buf_len);
+    img->buf_len = 0;
+  }
+}
+
+static void buffer_output(struct output_image* img, void* src, size_t count)
+{
+  if(img->sums)
+    add_checksums(img->sums, src, count);
+  if(img->discard)
+  {
+    stats_written(count);
+    return;
+  }
+
+  if(img->buf_len + count > opt.buffer_size)
+  {
+    flush_buffer(img);
+
+    if(count >= opt.buffer_size)                          /* nothing to gain from buffering this    */
+    {
+      drain_output(img);
+      write_all(img->fd, src, count);
+      return;
+    }
+  }
+
+  memcpy(img->buf + img->buf_len, src, count);
+  img->buf_len += count;
+}
+
+static void copy_passthrough(struct output_image* img)
+{
+  loff_t off = img->pt_offset;
+  size_t len = img->pt_len;
+  int64_t t;
+  ssize_t i;
+
+  if(img->sums)
+    add_checksums(img->sums, img->pt_src->map + off, len);
+  if(img->discard)
+  {
+    stats_written(len);
+    return;
+  }
+
+  drain_output(img);
+  while(len > 0)
+  {
+    t = stats_clock();
+    if(img->copy_mode == COPY_RANGE)
+      i = copy_file_range(img->pt_src->fd, &off, img->fd, NULL, len, 0);
+    else if(img->copy_mode == COPY_SPLICE)
+      i = splice(img->pt_src->fd, &off, img->fd, NULL, len, SPLICE_F_MORE);
+    else
+    {
+      write_all(img->fd, img->pt_src->map + off, len);
+      return;
+    }
+    stats_time(&stats.write_ns, t);
+
+    if(i < 0)
+    {
+      if(errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)
+        img->copy_mode = COPY_WRITE;                      /* not supported for this pair of files,  */
+      else if(errno != EAGAIN && errno != EINTR)          /* do it the old-fashioned way            */
+        perr_exit("copy");
+    }
+    else if(i == 0)
+    {
+      err_exit("copy: unexpected end of file\n");
+    }
+    else
+    {
+      stats_written(i);
+      len -= i;
+    }
+  }
+}
+
+static void end_passthrough(struct output_image* img)
+{
+  if(img->pt_len > 0)
+  {
+    if(img->pt_len < PASSTHROUGH_MIN)                     /* short spans are cheaper to copy into   */
+      buffer_output(img, img->pt_src->map + img->pt_offset, img->pt_len); /* the buffer */
+    else
+    {
+      flush_buffer(img);
+      copy_passthrough(img);
+    }
+    img->pt_len = 0;
+  }
+}
+
+/*
+ * Frames of a compressed delta are collected in a ring of slots by the 
+ * writing thread. With --threads they are compressed by worker threads,
+ * otherwise right away, and are written in order by the writing thread 
+ * when it needs the slot again or at the end.
+ */
+
+#define FRAME_FREE 0
+#define FRAME_FILLED 1
+#define FRAME_DONE 2
+
+struct frame
+{
+  int64_t seq;       /* number of the frame currently using this slot */
+  int state;
+  char* cmd;
+  size_t cmd_len;
+  char* payload;
+  size_t payload_len;
+  char* zdata;
+  size_t zlen;
+};
+
+struct frame_writer
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct frame* frames;
+  int nframes;
+  int nthreads;
+  pthread_t* threads;
+  int64_t next_fill;
+  int64_t next_compress;
+  int stop;
+  int level;
+  struct frame* cur;
+};
+
+static void compress_frame(struct frame* f, int level)
+{
+  uLongf len = compressBound(f->payload_len);
+
+  if(f->payload_len == 0 || compress2((Bytef*)f->zdata, &len, (Bytef*)f->payload, f->payload_len, level) != Z_OK || len >= f->payload_len)
+  {
+    memcpy(f->zdata, f->payload, f->payload_len);         /* not worth it */
+    len = f->payload_len;
+  }
+  f->zlen = len;
+}
+
+static void* frame_compressor(void* arg)
+{
+  struct frame_writer* zf = arg;
+  struct frame* f;
+
+  for(;;)
+  {
+    pthread_mutex_lock(&zf->lock);
+    for(;;)
+    {
+      f = &zf->frames[zf->next_compress % zf->nframes];
+      if(f->seq == zf->next_compress && f->state == FRAME_FILLED)
+        break;
+      if(zf->stop)
+      {
+        pthread_mutex_unlock(&zf->lock);
+        return NULL;
+      }
+      pthread_cond_wait(&zf->cond, &zf->lock);
+    }
+    zf->next_compress++;
+    pthread_mutex_unlock(&zf->lock);
+
+    compress_frame(f, zf->level);
+
+    pthread_mutex_lock(&zf->lock);
+    f->state = FRAME_DONE;
+    pthread_cond_broadcast(&zf->cond);
+    pthread_mutex_unlock(&zf->lock);
+  }
+}
+
+static void start_frames(struct output_image* img, int level, int nthreads)
+{
+  struct frame_writer* zf;
+  struct frame* f;
+  int i;
+
+  if((zf = calloc(1, sizeof(*zf))) == NULL)
+    perr_exit("failed to allocate frame writer");
+
+  pthread_mutex_init(&zf->lock, NULL);
+  pthread_cond_init(&zf->cond, NULL);
+  zf->level = level;
+  zf->nthreads = nthreads > 1 ? nthreads : 0;
+  zf->nframes = 2 * zf->nthreads + 1;
+
+  if((zf->frames = calloc(zf->nframes, sizeof(*zf->frames))) == NULL)
+    perr_exit("failed to allocate frame writer");
+  for(i = 0; i < zf->nframes; i++)
+  {
+    f = &zf->frames[i];
+    f->seq = i;
+    if((f->cmd = malloc(FRAME_BYTES + 2 * (1 + sizeof(int64_t)))) == NULL ||
+       (f->payload = malloc(FRAME_BYTES + NTFS_MAX_CLUSTER_SIZE)) == NULL ||
+       (f->zdata = malloc(compressBound(FRAME_BYTES + NTFS_MAX_CLUSTER_SIZE))) == NULL)
+      perr_exit("failed to allocate frame writer");
+  }
+
+  if(zf->nthreads && (zf->threads = calloc(zf->nthreads, sizeof(*zf->threads))) == NULL)
+    perr_exit("failed to allocate frame writer");
+  for(i = 0; i < zf->nthreads; i++)
+    if(pthread_create(&zf->threads[i], NULL, frame_compressor, zf) != 0)
+      err_exit("failed to create compressor thread\n");
+
+  zf->cur = &zf->frames[0];
+  img->zf = zf;
+}
+
+/* writes the compressed frames up to (excluding) number seq */
+static void write_frames(struct output_image* img, int64_t seq)
+{
+  struct frame_writer* zf = img->zf;
+  struct frame_hdr fh;
+  struct frame* f;
+  int64_t n;
+
+  for(n = seq - zf->nframes < 0 ? 0 : seq - zf->nframes; n < seq; n++)
+  {
+    f = &zf->frames[n % zf->nframes];
+    if(f->seq != n)                                       /* already written */
+      continue;
+
+    pthread_mutex_lock(&zf->lock);
+    while(f->state != FRAME_DONE)
+      pthread_cond_wait(&zf->cond, &zf->lock);
+    pthread_mutex_unlock(&zf->lock);
+
+    fh.cmd_len = cpu_to_le32(f->cmd_len);
+    fh.payload_len = cpu_to_le32(f->payload_len);
+    fh.zlen = cpu_to_le32(f->zlen);
+    buffer_output(img, &fh, sizeof(fh));
+    buffer_output(img, f->cmd, f->cmd_len);
+    buffer_output(img, f->zdata, f->zlen);
+
+    pthread_mutex_lock(&zf->lock);
+    f->state = FRAME_FREE;
+    f->seq += zf->nframes;
+    f->cmd_len = 0;
+    f->payload_len = 0;
+    pthread_mutex_unlock(&zf->lock);
+  }
+}
+
+static void seal_frame(struct output_image* img)
+{
+  struct frame_writer* zf = img->zf;
+  struct frame* f = zf->cur;
+
+  if(f->cmd_len == 0)
+    return;
+
+  if(!zf->nthreads)
+  {
+    compress_frame(f, zf->level);
+    f->state = FRAME_DONE;
+  }
+  else
+  {
+    pthread_mutex_lock(&zf->lock);
+    f->state = FRAME_FILLED;
+    pthread_cond_broadcast(&zf->cond);
+    pthread_mutex_unlock(&zf->lock);
+  }
+
+  zf->next_fill++;
+  zf->cur = &zf->frames[zf->next_fill % zf->nframes];
+  write_frames(img, zf->next_fill - zf->nframes + 1);     /* makes the next slot available */
+}
+
+/*
+ * The optional trailer of an uncompressed delta, for random access. For
+ * the first command starting at or after every step-th cluster it holds
+ * a seek_entry with the number of the cluster where the command starts,
+ * the offset of the command in the file and the number of CMD_DATA 
+ * payloads before it, which CMD_REF numbers are relative to. A seek_tail
+ * ends the file, so the entries are found from its end. Readers which 
+ * stop after the last cluster never notice the trailer.
+ */
+
+struct seek_entry
+{
+  int64_t cluster; /* all values are in little endian */
+  int64_t offset;
+  int64_t payload;
+}
+__attribute__((__packed__));
+
+struct seek_tail
+{
+  int64_t count;   /* of seek_entry before the tail */
+  int64_t step;
+  char magic[IMAGE_MAGIC_SIZE];
+}
+__attribute__((__packed__));
+
+#define SEEK_STEP 65536
+
+/* ends a delta with --checksums, after the seek index if there is one */
+struct checksum_tail
+{
+  int64_t count;   /* of crc32 values before the tail, for CHECK_BLOCK bytes each */
+  int64_t block;
+  char magic[IMAGE_MAGIC_SIZE];
+}
+__attribute__((__packed__));
+
+struct seek_index
+{
+  int64_t step;
+  int64_t next;    /* cluster for which the next entry is due */
+  int64_t count;
+  int64_t size;
+  struct seek_entry* entries;
+};
+
+static void add_seek_entry(struct output_image* img)
+{
+  struct seek_index* seek = img->seek;
+  struct seek_entry* e;
+
+  if(seek->count == seek->size)
+  {
+    seek->size = seek->size ? 2 * seek->size : 1024;
+    if((seek->entries = realloc(seek->entries, seek->size * sizeof(*seek->entries))) == NULL)
+      perr_exit("failed to allocate seek index");
+  }
+
+  e = &seek->entries[seek->count++];
+  e->cluster = cpu_to_sle64(img->clusters);
+  e->offset = cpu_to_sle64(img->pos);
+  e->payload = cpu_to_sle64(img->payloads);
+  seek->next = (img->clusters / seek->step + 1) * seek->step;
+}
+
+/* must be called before the first command is written */
+static void start_seek_index(struct output_image* img, int64_t step)
+{
+  if(img->zf)
+    err_exit("A seek index cannot be written for a compressed delta\n");
+
+  if((img->seek = calloc(1, sizeof(*img->seek))) == NULL)
+    perr_exit("failed to allocate seek index");
+  img->seek->step = step;
+  add_seek_entry(img);
+}
+
+static const char* const cmd_names[CMD_PATCH + 1] = { "skip", "data", "drop", "copy", "ref", "zero", "patch" };
+static int64_t cmd_runs[CMD_PATCH + 1];     /* commands written, for --stats */
+static int64_t cmd_clusters[CMD_PATCH + 1];
+
+static double mb_per_second(uint64_t bytes, int64_t ns)
+{
+  return ns > 0 ? (double)bytes / (1 << 20) / ns * NSEC : 0;
+}
+
+static void print_progress(int64_t now)
+{
+  int64_t ns = now - stats.start;
+  int i;
+
+  fprintf(stderr, "\r%5.1f%% %lld/%lld clusters, %.0f clusters/s,", 
+    stats.total > 0 ? 100.0 * stats.done / stats.total : 100.0, (long long)stats.done, (long long)stats.total,
+    ns > 0 ? (double)stats.done / ns * NSEC : 0);
+  for(i = 0; i < stats.nfiles; i++)
+    fprintf(stderr, " %s %.1f MB/s,", stats.files[i]->name, mb_per_second(__atomic_load_n(&stats.files[i]->bytes, __ATOMIC_RELAXED), ns));
+  fprintf(stderr, " out %.1f MB/s ", mb_per_second(__atomic_load_n(&stats.out_bytes, __ATOMIC_RELAXED), ns));
+  fflush(stderr);
+  stats.last_print = now;
+}
+
+/* counts a command written to the output, clusters long */
+static void stats_command(char cmd, int64_t clusters)
+{
+  int64_t now;
+
+  cmd_runs[(int)cmd]++;
+  cmd_clusters[(int)cmd] += clusters;
+  stats.done += clusters;
+
+  if(opt.progress && stats.done >= stats.next_check)
+  {
+    stats.next_check = stats.done + PROGRESS_CHECK;
+    if((now = stats_clock()) - stats.last_print >= NSEC)
+      print_progress(now);
+  }
+}
+
+static void write_json_string(FILE* f, const char* s)
+{
+  fputc('"', f);
+  for(; *s; s++)
+  {
+    if(*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if((unsigned char)*s < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char)*s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static void write_json(FILE* f, char* command, int64_t ns)
+{
+  int i;
+
+  fprintf(f, "{\"command\":\"%s\",\"seconds\":%.3f,\"clusters\":%lld,\"total_clusters\":%lld,\"clusters_per_second\":%.0f,",
+    command, (double)ns / NSEC, (long long)stats.done, (long long)stats.total, ns > 0 ? (double)stats.done / ns * NSEC : 0);
+  fprintf(f, "\"read_seconds\":%.3f,\"write_seconds\":%.3f,\"compare_seconds\":%.3f,\"inputs\":[", 
+    (double)stats.read_ns / NSEC, (double)stats.write_ns / NSEC, (double)stats.compare_ns / NSEC);
+  for(i = 0; i < stats.nfiles; i++)
+  {
+    fprintf(f, "%s{\"name\":", i ? "," : "");
+    write_json_string(f, stats.files[i]->name);
+    fprintf(f, ",\"bytes\":%llu,\"mb_per_second\":%.1f}", (unsigned long long)stats.files[i]->bytes, mb_per_second(stats.files[i]->bytes, ns));
+  }
+  fprintf(f, "],\"output\":{\"name\":");
+  write_json_string(f, stats.out_name ? stats.out_name : "");
+  fprintf(f, ",\"bytes\":%llu,\"mb_per_second\":%.1f},\"commands\":{", (unsigned long long)stats.out_bytes, mb_per_second(stats.out_bytes, ns));
+  for(i = 0; i <= CMD_PATCH; i++)
+    fprintf(f, "%s\"%s\":{\"runs\":%lld,\"clusters\":%lld}", i ? "," : "", cmd_names[i], (long long)cmd_runs[i], (long long)cmd_clusters[i]);
+  fprintf(f, "}}\n");
+}
+
+/* the summary at the end of a successful run */
+static void finish_stats(char* command)
+{
+  int64_t now = stats_clock(), ns = now - stats.start;
+  FILE* f;
+  int i;
+
+  if(!stats.enabled)
+    return;
+
+  if(opt.progress)
+  {
+    print_progress(now);
+    fprintf(stderr, "\n");
+  }
+
+  if(opt.stats)
+  {
+    fprintf(stderr, "%lld clusters in %.3f s, %.0f clusters/s\n", 
+      (long long)stats.done, (double)ns / NSEC, ns > 0 ? (double)stats.done / ns * NSEC : 0);
+    fprintf(stderr, "waiting for reads %.3f s, for writes %.3f s, comparing %.3f s\n",
+      (double)stats.read_ns / NSEC, (double)stats.write_ns / NSEC, (double)stats.compare_ns / NSEC);
+    for(i = 0; i < stats.nfiles; i++)
+      fprintf(stderr, "read %s: %llu bytes, %.1f MB/s\n", stats.files[i]->name, 
+        (unsigned long long)stats.files[i]->bytes, mb_per_second(stats.files[i]->bytes, ns));
+    fprintf(stderr, "written %s: %llu bytes, %.1f MB/s\n", stats.out_name ? stats.out_name : "-", 
+      (unsigned long long)stats.out_bytes, mb_per_second(stats.out_bytes, ns));
+    for(i = 0; i <= CMD_PATCH; i++)
+      if(cmd_runs[i] > 0)
+        fprintf(stderr, "%-5s %lld runs, %lld clusters\n", cmd_names[i], (long long)cmd_runs[i], (long long)cmd_clusters[i]);
+  }
+
+  if(opt.stats_json)
+  {
+    if((f = fopen(opt.stats_json, "w")) == NULL)
+      perr_exit("failed to open statistics file");
+    write_json(f, command, ns);
+    fclose(f);
+  }
+}
+
+/*
+ * stat makes a delta without writing it, or reads an existing one, and
+ * counts which clusters it changes: the runs of changed clusters by
+ * their length, and with --ranges all of them, in the format of the list
+ * of --changed. With --sample N, only one in N runs of SAMPLE_RUN 
+ * clusters is compared, and the rest is estimated from them.
+ */
+
+#define HISTOGRAM_BUCKETS 64
+
+static struct
+{
+  int enabled;
+  int64_t pos;        /* clusters covered by the commands so far */
+  int64_t changed;
+  int64_t runs;
+  int64_t run_first;  /* the current run of changed clusters */
+  int64_t run_count;
+  int64_t histogram[HISTOGRAM_BUCKETS]; /* runs by log2 of their length */
+  FILE* ranges;
+}
+delta_stat;
+
+static void end_changed_run()
+{
+  int b = 0;
+
+  if(delta_stat.run_count == 0)
+    return;
+
+  while(b < HISTOGRAM_BUCKETS - 1 && delta_stat.run_count >> (b + 1))
+    b++;
+  delta_stat.histogram[b]++;
+  delta_stat.runs++;
+  if(delta_stat.ranges)
+    fprintf(delta_stat.ranges, "%lld %lld\n", (long long)delta_stat.run_first, (long long)delta_stat.run_count);
+  delta_stat.run_count = 0;
+}
+
+static void stat_command(char cmd, int64_t clusters)
+{
+  if(cmd != CMD_SKIP)
+  {
+    if(delta_stat.run_first + delta_stat.run_count != delta_stat.pos)
+      end_changed_run();
+    if(delta_stat.run_count == 0)
+      delta_stat.run_first = delta_stat.pos;
+    delta_stat.run_count += clusters;
+    delta_stat.changed += clusters;
+  }
+  delta_stat.pos += clusters;
+}
+
+/* 
+ * called after each complete command, which covered the given number of 
+ * clusters, frames only end at these points
+ */
+static void end_command(struct output_image* img, char cmd, int64_t clusters)
+{
+  if(stats.enabled)
+    stats_command(cmd, clusters);
+  if(delta_stat.enabled)
+    stat_command(cmd, clusters);
+
+  img->clusters += clusters;
+  if(img->seek && img->clusters >= img->seek->next)
+    add_seek_entry(img);
+
+  if(img->zf && (img->zf->cur->cmd_len >= FRAME_BYTES || img->zf->cur->payload_len >= FRAME_BYTES))
+    seal_frame(img);
+}
+
+static void finish_frames(struct output_image* img)
+{
+  struct frame_writer* zf = img->zf;
+  int i;
+
+  seal_frame(img);
+  write_frames(img, zf->next_fill);
+
+  pthread_mutex_lock(&zf->lock);
+  zf->stop = 1;
+  pthread_cond_broadcast(&zf->cond);
+  pthread_mutex_unlock(&zf->lock);
+  for(i = 0; i < zf->nthreads; i++)
+    pthread_join(zf->threads[i], NULL);
+
+  for(i = 0; i < zf->nframes; i++)
+  {
+    free(zf->frames[i].cmd);
+    free(zf->frames[i].payload);
+    free(zf->frames[i].zdata);
+  }
+  free(zf->frames);
+  free(zf->threads);
+  pthread_cond_destroy(&zf->cond);
+  pthread_mutex_destroy(&zf->lock);
+  free(zf);
+  img->zf = NULL;
+}
+
+static void flush_output(struct output_image* img)
+{
+  if(img->zf)
+    finish_frames(img);
+  end_passthrough(img);
+  flush_buffer(img);
+  drain_output(img);
+}
+
+/* for command codes and their arguments, which a raw volume does not have */
+static void write_output(struct output_image* img, void* src, size_t count)
+{
+  struct frame* f;
+
+  if(img->raw)
+    return;
+
+  if(img->zf)
+  {
+    f = img->zf->cur;
+    memcpy(f->cmd + f->cmd_len, src, count);
+    f->cmd_len += count;
+    return;
+  }
+
+  end_passthrough(img);
+  buffer_output(img, src, count);
+  img->pos += count;
+}
+
+static void write_payload(struct output_image* img, void* src, size_t count)
+{
+  struct frame* f;
+
+  if(img->zf)
+  {
+    f = img->zf->cur;
+    memcpy(f->payload + f->payload_len, src, count);
+    f->payload_len += count;
+    return;
+  }
+
+  if(img->raw)
+    buffer_output(img, src, count);
+  else
+    write_output(img, src, count);
+}
+
+static void write_seek_index(struct output_image* img)
+{
+  struct seek_index* seek = img->seek;
+  struct seek_tail tail;
+
+  img->seek = NULL;                                       /* the trailer is not a command           */
+  if(sle64_to_cpu(seek->entries[seek->count - 1].offset) == img->pos)
+    seek->count--;                                        /* due after the last command             */
+  write_output(img, seek->entries, seek->count * sizeof(*seek->entries));
+
+  tail.count = cpu_to_sle64(seek->count);
+  tail.step = cpu_to_sle64(seek->step);
+  memcpy(tail.magic, SEEK_MAGIC, IMAGE_MAGIC_SIZE);
+  write_output(img, &tail, sizeof(tail));
+
+  free(seek->entries);
+  free(seek);
+}
+
+static void write_checksums(struct output_image* img)
+{
+  struct checksums* sums = img->sums;
+  struct checksum_tail tail;
+
+  if(img->zf)                                             /* the trailer is not part of a frame     */
+    finish_frames(img);
+  end_passthrough(img);
+
+  img->sums = NULL;
+  finish_checksums(sums);
+  buffer_output(img, sums->crcs, sums->count * sizeof(*sums->crcs));
+
+  tail.count = cpu_to_sle64(sums->count);
+  tail.block = cpu_to_sle64(CHECK_BLOCK);
+  memcpy(tail.magic, CHECK_MAGIC, IMAGE_MAGIC_SIZE);
+  buffer_output(img, &tail, sizeof(tail));
+
+  free(sums->crcs);
+  free(sums);
+}
+
+/*
+ * With --resume FILE, delta and patch (without --threads) record a 
+ * checkpoint in FILE every CHECKPOINT_STEP clusters: how far they got in
+ * the volume, where the next command of each image starts, and the state
+ * of the output. The output is synced first, so that everything the 
+ * checkpoint refers to is on disk, and FILE is replaced atomically. A 
+ * rerun with the same files and --resume FILE truncates the output to the
+ * checkpoint, seeks the images to it and goes on from there. The deltas
+ * a patch reads are skipped up to the checkpoint instead, from the start,
+ * because the back references of CMD_REF need the payloads before it. 
+ * FILE is removed at the end. It is in the byte order of the machine.
+ */
+
+#define CHECKPOINT_STEP (1 << 18)
+#define CHECKPOINT_MAGIC "\0ntfsclone-chkpt"
+
+struct checkpoint
+{
+  char magic[IMAGE_MAGIC_SIZE];
+  char command;           /* 'd' for delta, 'p' for patch */
+  uint32_t csize;
+  int64_t nr_clusters;
+  int64_t old_size;       /* of OLDFILE */
+  uint32_t inputs_crc;    /* of the sizes and headers of NEWFILE or every delta */
+  int64_t pos;            /* clusters done */
+  int64_t in_offset[2];   /* of the next command of OLDFILE and NEWFILE */
+  int64_t in_repeat[2];
+  char in_cmd[2];
+  int64_t out_offset;     /* bytes of the output, or raw_offset */
+  int64_t out_clusters;
+  int64_t out_payloads;
+  int64_t out_repeat;     /* and cmd of the pending command */
+  char out_cmd;
+};
+
+static struct
+{
+  int active;             /* ck was loaded from the file */
+  int64_t next;           /* cluster of the next checkpoint */
+  struct checkpoint ck;
+}
+resume;
+
+/* the options under which the progress of command fits in a checkpoint */
+static void check_resume(char command, char* file1, char** files, int count, char* file3)
+{
+  int i;
+
+  for(i = 0; i < count; i++)
+    if(strcmp(files[i], "-") == 0)
+      err_exit("--resume needs named files, not stdin or stdout\n");
+  if(strcmp(file1, "-") == 0 || strcmp(file3, "-") == 0)
+    err_exit("--resume needs named files, not stdin or stdout\n");
+  if(opt.io_uring)
+    err_exit("--resume does not work with --io-uring\n");
+  if(command == 'd' && (opt.threads > 1 || opt.compress >= 0 || opt.dedup || opt.seek_step || opt.checksums || opt.device))
+    err_exit("A delta can only be resumed without --threads, -z, -d, -x, --checksums and --from-device\n");
+}
+
+static int64_t file_size(int fd)
+{
+  struct stat st;
+
+  if(fstat(fd, &st) == -1)
+    perr_exit("fstat");
+  return st.st_size;
+}
+
+/* where the next command of an image starts, in the file */
+static int64_t input_offset(struct input_image* img)
+{
+  off_t off;
+
+  if(img->map)
+    return img->map_pos;
+  if((off = lseek(img->fd, 0, SEEK_CUR)) == (off_t)-1)
+    perr_exit("lseek");
+  return off - (img->buf_len - img->buf_pos);
+}
+
+static void seek_input(struct input_image* img, int64_t offset, char cmd, int64_t repeat)
+{
+  if(img->map)
+  {
+    img->map_pos = img->map_released = offset;
+    img->map_released &= ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+  }
+  else if(lseek(img->fd, offset, SEEK_SET) == (off_t)-1)
+    perr_exit("failed to seek input image");
+  img->buf_pos = img->buf_len = 0;
+  img->cmd = cmd;
+  img->cmd_repeat = repeat;
+}
+
+static uint32_t inputs_crc(struct input_image* inputs, int count)
+{
+  uint32_t crc = crc32(0L, Z_NULL, 0);
+  int64_t size;
+  int i;
+
+  for(i = 0; i < count; i++)
+  {
+    size = file_size(inputs[i].fd);
+    crc = crc32(crc, (const Bytef*)&size, sizeof(size));
+    crc = crc32(crc, (const Bytef*)&inputs[i].hdr, ((size_t)&((struct image_hdr*)0)->offset_to_image_data));
+    if(inputs[i].hdr_extra_len)
+      crc = crc32(crc, (const Bytef*)inputs[i].hdr_extra, inputs[i].hdr_extra_len);
+  }
+
+  return crc;
+}
+
+/* 
+ * loads the checkpoint of FILE, if there is one, and with it goes on 
+ * where it left off: returns the first cluster still to do. The output 
+ * must have just been created, with only its header written. inputs are 
+ * NEWFILE for a delta, or the count deltas of a patch.
+ */
+static int64_t start_resume(char command, struct input_image* old, struct input_image* inputs, int count, struct output_image* out)
+{
+  struct checkpoint* ck = &resume.ck;
+  char* hdr;
+
+  resume.next = CHECKPOINT_STEP;
+  if(!resume.active)
+  {
+    ck->old_size = file_size(old->fd);
+    ck->inputs_crc = inputs_crc(inputs, count);
+    return 0;
+  }
+
+  if(ck->command != command || ck->csize != old->csize || ck->nr_clusters != old->ccount || 
+     ck->old_size != file_size(old->fd) || ck->inputs_crc != inputs_crc(inputs, count))
+    err_exit("The checkpoint in %s is for other files than these\n", opt.resume);
+
+  if(!out->raw)                                           /* the header must be there already       */
+  {
+    if((hdr = malloc(out->buf_len)) == NULL)
+      perr_exit("failed to allocate header");
+    if(pread(out->fd, hdr, out->buf_len, 0) != (ssize_t)out->buf_len || memcmp(hdr, out->buf, out->buf_len) != 0 ||
+       file_size(out->fd) < ck->out_offset)
+      err_exit("The output does not fit the checkpoint in %s\n", opt.resume);
+    free(hdr);
+    out->buf_len = 0;
+    if(ftruncate(out->fd, ck->out_offset) == -1 || lseek(out->fd, ck->out_offset, SEEK_SET) == (off_t)-1)
+      perr_exit("failed to truncate output image");
+    out->pos = ck->out_offset;
+  }
+  else
+    out->raw_offset = ck->out_offset;
+  out->clusters = ck->out_clusters;
+  out->payloads = ck->out_payloads;
+  out->cmd = ck->out_cmd;
+  out->cmd_repeat = ck->out_repeat;
+
+  seek_input(old, ck->in_offset[0], ck->in_cmd[0], ck->in_repeat[0]);
+  if(command == 'd')                                      /* the deltas of a patch are skipped      */
+    seek_input(inputs, ck->in_offset[1], ck->in_cmd[1], ck->in_repeat[1]);
+
+  resume.next = ck->pos + CHECKPOINT_STEP;
+  fprintf(stderr, "Resuming at cluster %lld of %lld\n", (long long)ck->pos, (long long)old->ccount);
+  return ck->pos;
+}
+
+static void load_checkpoint()
+{
+  int fd;
+
+  if((fd = open(opt.resume, O_RDONLY)) == -1)
+  {
+    if(errno != ENOENT)
+      perr_exit("failed to open checkpoint");
+    return;                                               /* nothing to resume, start from scratch  */
+  }
+  if(read(fd, &resume.ck, sizeof(resume.ck)) != sizeof(resume.ck) || 
+     memcmp(resume.ck.magic, CHECKPOINT_MAGIC, IMAGE_MAGIC_SIZE) != 0)
+    err_exit("%s is not a checkpoint\n", opt.resume);
+  close(fd);
+  resume.active = 1;
+}
+
+/* after the first pos clusters, new is NULL for a patch */
+static void write_checkpoint(int64_t pos, struct input_image* old, struct input_image* new, struct output_image* out)
+{
+  struct checkpoint* ck = &resume.ck;
+  char* tmp;
+  int fd;
+
+  flush_output(out);
+  if(fsync(out->fd) == -1)
+    perr_exit("failed to sync output");
+
+  memcpy(ck->magic, CHECKPOINT_MAGIC, IMAGE_MAGIC_SIZE);
+  ck->command = new ? 'd' : 'p';
+  ck->csize = old->csize;
+  ck->nr_clusters = old->ccount;
+  ck->pos = pos;
+  ck->in_offset[0] = input_offset(old);
+  ck->in_repeat[0] = old->cmd_repeat;
+  ck->in_cmd[0] = old->cmd;
+  if(new)
+  {
+    ck->in_offset[1] = input_offset(new);
+    ck->in_repeat[1] = new->cmd_repeat;
+    ck->in_cmd[1] = new->cmd;
+  }
+  ck->out_offset = out->raw ? out->raw_offset : out->pos;
+  ck->out_clusters = out->clusters;
+  ck->out_payloads = out->payloads;
+  ck->out_repeat = out->cmd_repeat;
+  ck->out_cmd = out->cmd;
+
+  if(asprintf(&tmp, "%s.tmp", opt.resume) == -1)
+    perr_exit("failed to allocate file name");
+  if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+    perr_exit("failed to write checkpoint");
+  if(write(fd, ck, sizeof(*ck)) != sizeof(*ck) || fsync(fd) == -1 || close(fd) == -1 || rename(tmp, opt.resume) == -1)
+    perr_exit("failed to write checkpoint");
+  free(tmp);
+
+  resume.next = pos + CHECKPOINT_STEP;
+}
+
+static void finish_resume()
+{
+  if(unlink(opt.resume) == -1 && errno != ENOENT)
+    perr_exit("failed to remove checkpoint");
+}
+
+/*
+ * --raw output to a block device or a sparse file, with every cluster at
+ * its place on the volume. Unused clusters are skipped, on block devices
+ * they are discarded if the device supports it.
+ */
+static void create_raw_output(char* file, struct output_image* img, struct input_image* old_img)
+{
+  struct stat st;
+  uint64_t size = sle64_to_cpu(old_img->hdr.device_size);
+  int sector = 512;
+
+  memset(img, 0, sizeof(*img));
+  img->cmd = CMD_DATA;
+  img->raw = 1;
+  stats.out_name = file;
+  stats.total = old_img->ccount + old_img->bbs_present;
+  img->csize = old_img->csize;
+
+  if(strcmp(file, "-") == 0)
+    err_exit("A raw volume cannot be written to stdout\n");
+
+  if((img->fd = open(file, O_WRONLY | O_CREAT | (opt.direct ? O_DIRECT : 0), 0666)) == -1 || fstat(img->fd, &st) == -1)
+    perr_exit("failed to open output volume");
+
+  if(S_ISBLK(st.st_mode))
+  {
+    if(ioctl(img->fd, BLKGETSIZE64, &size) == -1 || ioctl(img->fd, BLKSSZGET, &sector) == -1)
+      perr_exit("failed to get the size of the output device");
+    if(size < (uint64_t)sle64_to_cpu(old_img->hdr.device_size))
+      err_exit("Output device is smaller than the volume\n");
+    img->punch = 1;
+  }
+  else if(!S_ISREG(st.st_mode))
+    err_exit("A raw volume can only be written to a block device or a regular file\n");
+  else if(!resume.active && (ftruncate(img->fd, 0) == -1 || ftruncate(img->fd, size) == -1))
+    perr_exit("failed to truncate output volume");
+
+  if(opt.direct && img->csize % sector != 0)
+    err_exit("O_DIRECT needs clusters of a multiple of %d bytes\n", sector);
+
+  if(posix_memalign((void**)&img->buf, 4096, opt.buffer_size) != 0)
+    perr_exit("failed to allocate output buffer");
+  if(opt.io_uring)
+    start_uring_output(img);
+}
+
+static void skip_raw(struct output_image* img, int64_t count)
+{
+  flush_buffer(img);
+
+  if(img->punch && fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, img->raw_offset, count * img->csize) == -1)
+  {
+    if(errno != EOPNOTSUPP && errno != ENOSYS)
+      perr_exit("failed to discard unused clusters");
+    img->punch = 0;
+  }
+
+  img->raw_offset += count * img->csize;
+}
+
+static void create_output_image(char* file, struct output_image* img, char* magic, struct input_image* old_img)
+{
+  struct stat st;
+
+  memset(img, 0, sizeof(*img));
+  img->cmd = CMD_DATA;
+  stats.out_name = file;
+  stats.total = old_img->ccount + old_img->bbs_present;
+
+  if(file == NULL)                                        /* nowhere, for stat                      */
+  {
+    img->fd = -1;
+    img->discard = 1;
+  }
+  else if(strcmp(file, "-") == 0) 
+  {
+    if((img->fd = fileno(stdout)) == -1)
+      perr_exit("fileno for stdout failed");
+  }
+  else
+  {
+    if((img->fd = open(file, resume.active ? O_RDWR | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+      perr_exit("failed to open output image");
+  }
+
+  if((img->buf = malloc(opt.buffer_size)) == NULL)
+    perr_exit("failed to allocate output buffer");
+
+  if(opt.checksums && delta_kind(magic) >= 0)
+    img->sums = create_checksums();
+
+  if(fstat(img->fd, &st) == 0 && S_ISREG(st.st_mode))
+    img->copy_mode = COPY_RANGE;
+  else if(fstat(img->fd, &st) == 0 && S_ISFIFO(st.st_mode))
+    img->copy_mode = COPY_SPLICE;
+
+  if(file && strcmp(file, "-") != 0 && fstat(img->fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+    img->seekable = 1;
+  if(img->seekable && opt.io_uring)
+    start_uring_output(img);
+  
+  write_output(img, magic, IMAGE_MAGIC_SIZE);
+  write_output(img, &old_img->hdr.major_ver, sizeof(old_img->hdr) - IMAGE_MAGIC_SIZE);
+
+  if(old_img->hdr_extra_len)
+    write_output(img, old_img->hdr_extra, old_img->hdr_extra_len);
+
+  if(delta_kind(magic) >= 0 && (delta_kind(magic) & DELTA_COMPRESSED))
+    start_frames(img, opt.compress, opt.threads);
+  
+//fprintf(stderr, "Image opened for writing: %s\n", file); fflush(stderr);
+}
+
+/* 
+ * reads the command code of the next cluster, but not its payload, 
+ * allow_drop_cmd is set for deltas and allows all of their commands
+ */
+static void read_next_cmd(struct input_image* img, int allow_drop_cmd)
+{
+  read_cmd_input(img, &img->cmd, sizeof(img->cmd));
+
+  if(allow_drop_cmd && (img->cmd == CMD_COPY || img->cmd == CMD_REF))
+  {
+    read_cmd_input(img, &img->cmd_arg, sizeof(img->cmd_arg));
+    img->cmd_arg = sle64_to_cpu(img->cmd_arg);
+  }
+  else if(img->cmd == CMD_SKIP || (allow_drop_cmd && (img->cmd == CMD_DROP || img->cmd == CMD_ZERO)))
+  {
+    read_cmd_input(img, &img->cmd_repeat, sizeof(img->cmd_repeat));
+
+    img->cmd_repeat = sle64_to_cpu(img->cmd_repeat);
+
+    if(img->cmd_repeat == 0)
+      err_exit("Zero repeat length after command code in image\n");
+
+//fprintf(stderr, "<%d:%d:%lld>", img->fd, (int)img->cmd, img->cmd_repeat); 
+
+    img->cmd_repeat--;
+  } 
+  else if(allow_drop_cmd && img->cmd == CMD_PATCH)
+    read_cmd_input(img, img->patch_map, PATCH_MAP_SIZE(img->csize));
+  else if(img->cmd != CMD_DATA) 
+    err_exit("Invalid command code in image\n");
+}
+
+/* size of the payload of a CMD_PATCH */
+static uint32_t patch_size(const char* map, uint32_t csize)
+{
+  uint32_t s, n = 0;
+
+  for(s = 0; s < csize / NTFS_SECTOR_SIZE; s++)
+    n += (map[s >> 3] >> (s & 7)) & 1;
+
+  return n * NTFS_SECTOR_SIZE;
+}
+
+/* overlays the changed sectors of a CMD_PATCH on cluster */
+static void patch_sectors(char* cluster, const char* map, const char* sectors, uint32_t csize)
+{
+  uint32_t s;
+
+  for(s = 0; s < csize / NTFS_SECTOR_SIZE; s++)
+  {
+    if((map[s >> 3] >> (s & 7)) & 1)
+    {
+      memcpy(cluster + s * NTFS_SECTOR_SIZE, sectors, NTFS_SECTOR_SIZE);
+      sectors += NTFS_SECTOR_SIZE;
+    }
+  }
+}
+
+/*
+ * The payloads of the last DEDUP_WINDOW bytes of CMD_DATA clusters in a 
+ * delta, numbered from the start of the delta. CMD_REF refers to them by 
+ * their number. The payloads are copied, unless they come from a mapped 
+ * file where they stay put anyway. The writer of a delta also hashes 
+ * them into a small table to find duplicates.
+ */
+
+struct dedup_entry
+{
+  uint64_t key;
+  int64_t seq;   /* -1 for an empty slot */
+};
+
+struct payload_ring
+{
+  int64_t count; /* number of payloads seen so far */
+  int64_t size;
+  uint32_t csize;
+  char** cdata;
+  char* store;
+  struct dedup_entry* table;
+  uint64_t mask;
+};
+
+static struct payload_ring* create_ring(uint32_t csize, int mapped, int with_table)
+{
+  struct payload_ring* ring;
+  int64_t i;
+
+  if((ring = calloc(1, sizeof(*ring))) == NULL)
+    perr_exit("failed to allocate payload ring");
+
+  ring->size = DEDUP_WINDOW / csize;
+  ring->csize = csize;
+  if((ring->cdata = malloc(ring->size * sizeof(*ring->cdata))) == NULL ||
+     (!mapped && (ring->store = malloc((size_t)ring->size * csize)) == NULL))
+    perr_exit("failed to allocate payload ring");
+
+  if(with_table)
+  {
+    ring->mask = 2 * ring->size - 1;
+    if((ring->table = malloc((ring->mask + 1) * sizeof(*ring->table))) == NULL)
+      perr_exit("failed to allocate payload ring");
+    for(i = 0; i <= (int64_t)ring->mask; i++)
+      ring->table[i].seq = -1;
+  }
+
+  return ring;
+}
+
+static char* ring_add(struct payload_ring* ring, char* cdata)
+{
+  char** slot = &ring->cdata[ring->count++ % ring->size];
+
+  if(ring->store)
+  {
+    *slot = ring->store + (size_t)(slot - ring->cdata) * ring->csize;
+    memcpy(*slot, cdata, ring->csize);
+  }
+  else
+    *slot = cdata;
+
+  return *slot;
+}
+
+/* counts a payload without keeping it, it is never referred back to */
+static void ring_skip(struct payload_ring* ring)
+{
+  ring->cdata[ring->count++ % ring->size] = NULL;
+}
+
+static char* ring_get(struct payload_ring* ring, int64_t seq)
+{
+  if(seq < 0 || seq >= ring->count || seq < ring->count - ring->size)
+    return NULL;
+  return ring->cdata[seq % ring->size];
+}
+
+static char zero_cluster[NTFS_MAX_CLUSTER_SIZE];
+static char patched_cluster[NTFS_MAX_CLUSTER_SIZE]; /* a CMD_PATCH applied to its old cluster */
+
+static void read_next_cluster(struct input_image* img, int allow_drop_cmd)
+{
+  if(img->cmd_repeat > 0)
+    img->cmd_repeat--;
+  else 
+  {
+    read_next_cmd(img, allow_drop_cmd);
+
+    if(img->cmd == CMD_DATA) 
+    {
+      img->cdata = read_payload_ptr(img, img->psize);
+      if(img->ring)
+        img->cdata = ring_add(img->ring, img->cdata);
+    }
+    else if(img->cmd == CMD_REF)                          /* just like the earlier CMD_DATA from    */
+    {                                                     /* here on                                */
+      if(!img->ring || (img->cdata = ring_get(img->ring, img->cmd_arg)) == NULL)
+        err_exit("Invalid back reference in delta\n");
+      img->cmd = CMD_DATA;
+    }
+    else if(img->cmd == CMD_ZERO)                         /* a CMD_DATA cluster without payload,    */
+    {                                                     /* for the whole run                      */
+      img->cdata = zero_cluster;
+      img->cmd = CMD_DATA;
+    }
+    else if(img->cmd == CMD_PATCH)                        /* the changed sectors, not in the ring   */
+      img->cdata = read_payload_ptr(img, patch_size(img->patch_map, img->csize));
+  }
+}
+
+/*
+ * Random access to the clusters of a mapped image. The locator remembers
+ * the command covering every LOCATOR_STEP-th cluster, from where the
+ * command codes are followed to the wanted cluster. Deltas work the same
+ * way, and if they end with a seek index, they are cut into segments at
+ * its entries, each of which is only scanned when it is first needed.
+ */
+
+#define LOCATOR_STEP 64
+
+struct locator_entry
+{
+  size_t offset;   /* of the command in the mapping */
+  int64_t cluster; /* first cluster covered by that command */
+  int64_t payload; /* number of CMD_DATA payloads before that command */
+};
+
+struct cluster_locator
+{
+  int64_t nclusters;
+  int64_t used;    /* in the scanned segments */
+  int allow_drop_cmd;
+  struct locator_entry* entries;
+  struct locator_entry* segments;
+  int64_t nsegments;
+  char* scanned;
+};
+
+struct mapped_cmd
+{
+  char cmd;
+  int64_t arg;     /* of CMD_COPY and CMD_REF */
+  char* cdata;     /* payload of CMD_DATA or CMD_PATCH, NULL otherwise */
+  char* map;       /* sector map of CMD_PATCH */
+};
+
+/* steps over the command at *pos, returns how many clusters it covers */
+static int64_t step_mapped(struct input_image* img, size_t* pos, int allow_drop_cmd, struct mapped_cmd* m)
+{
+  int64_t repeat;
+
+  if(*pos >= img->map_size)
+    err_exit("read: unexpected end of file\n");
+
+  m->cmd = img->map[*pos];
+  m->cdata = NULL;
+
+  if(m->cmd == CMD_SKIP || (allow_drop_cmd && (m->cmd == CMD_DROP || m->cmd == CMD_ZERO)))
+  {
+    if(*pos + 1 + sizeof(repeat) > img->map_size)
+      err_exit("read: unexpected end of file\n");
+    memcpy(&repeat, img->map + *pos + 1, sizeof(repeat));
+    if((repeat = sle64_to_cpu(repeat)) <= 0)
+      err_exit("Zero repeat length after command code in image\n");
+    *pos += 1 + sizeof(repeat);
+    return repeat;
+  }
+  else if(allow_drop_cmd && (m->cmd == CMD_COPY || m->cmd == CMD_REF))
+  {
+    if(*pos + 1 + sizeof(m->arg) > img->map_size)
+      err_exit("read: unexpected end of file\n");
+    memcpy(&m->arg, img->map + *pos + 1, sizeof(m->arg));
+    m->arg = sle64_to_cpu(m->arg);
+    *pos += 1 + sizeof(m->arg);
+    return 1;
+  }
+  else if(m->cmd == CMD_DATA)
+  {
+    if(*pos + 1 + img->psize > img->map_size)
+      err_exit("read: unexpected end of file\n");
+    m->cdata = img->map + *pos + 1;
+    *pos += 1 + img->psize;
+    return 1;
+  }
+  else if(allow_drop_cmd && m->cmd == CMD_PATCH)
+  {
+    if(*pos + 1 + PATCH_MAP_SIZE(img->csize) > img->map_size ||
+       *pos + 1 + PATCH_MAP_SIZE(img->csize) + patch_size(img->map + *pos + 1, img->csize) > img->map_size)
+      err_exit("read: unexpected end of file\n");
+    m->map = img->map + *pos + 1;
+    m->cdata = m->map + PATCH_MAP_SIZE(img->csize);
+    *pos += 1 + PATCH_MAP_SIZE(img->csize) + patch_size(m->map, img->csize);
+    return 1;
+  }
+  else
+    err_exit("Invalid command code in image\n");
+
+  return 0;
+}
+
+/* returns the size of the checksums at the end of a buffer, 0 if there are none */
+static size_t checksums_size(const char* buf, size_t len)
+{
+  struct checksum_tail tail;
+
+  if(len < sizeof(tail))
+    return 0;
+  memcpy(&tail, buf + len - sizeof(tail), sizeof(tail));
+  if(memcmp(tail.magic, CHECK_MAGIC, IMAGE_MAGIC_SIZE) != 0)
+    return 0;
+
+  tail.count = sle64_to_cpu(tail.count);
+  if(tail.count < 0 || (uint64_t)tail.count > (len - sizeof(tail)) / sizeof(uint32_t) || sle64_to_cpu(tail.block) != CHECK_BLOCK)
+    err_exit("Invalid checksums in delta\n");
+  return sizeof(tail) + tail.count * sizeof(uint32_t);
+}
+
+/* takes the entries of the seek index at the end of a delta as segments */
+static int load_seek_segments(struct input_image* img, struct cluster_locator* loc)
+{
+  struct seek_tail tail;
+  struct seek_entry e;
+  size_t start, end;
+  int64_t i;
+
+  end = img->map_size - checksums_size(img->map + img->data_start, img->map_size - img->data_start);
+  if(end < img->data_start + sizeof(tail))
+    return 0;
+  memcpy(&tail, img->map + end - sizeof(tail), sizeof(tail));
+  if(memcmp(tail.magic, SEEK_MAGIC, IMAGE_MAGIC_SIZE) != 0)
+    return 0;
+
+  tail.count = sle64_to_cpu(tail.count);
+  if(tail.count < 1 || (uint64_t)tail.count > (end - img->data_start - sizeof(tail)) / sizeof(e))
+    err_exit("Invalid seek index in delta\n");
+  start = end - sizeof(tail) - tail.count * sizeof(e);
+
+  if((loc->segments = malloc(tail.count * sizeof(*loc->segments))) == NULL)
+    perr_exit("failed to allocate cluster locator");
+
+  for(i = 0; i < tail.count; i++)
+  {
+    memcpy(&e, img->map + start + i * sizeof(e), sizeof(e));
+    loc->segments[i].cluster = sle64_to_cpu(e.cluster);
+    loc->segments[i].offset = sle64_to_cpu(e.offset);
+    loc->segments[i].payload = sle64_to_cpu(e.payload);
+    if(loc->segments[i].offset < img->data_start || loc->segments[i].offset >= start ||
+       (i == 0 ? loc->segments[i].cluster != 0 : loc->segments[i].cluster <= loc->segments[i - 1].cluster))
+      err_exit("Invalid seek index in delta\n");
+  }
+
+  loc->nsegments = tail.count;
+  return 1;
+}
+
+static void scan_segment(struct input_image* img, struct cluster_locator* loc, int64_t s)
+{
+  struct mapped_cmd m;
+  size_t pos, start;
+  int64_t c, k, n, end, payload;
+
+  end = s + 1 < loc->nsegments ? loc->segments[s + 1].cluster : loc->nclusters;
+  pos = loc->segments[s].offset;
+  payload = loc->segments[s].payload;
+
+  for(c = loc->segments[s].cluster; c < end; c += n)
+  {
+    start = pos;
+    n = step_mapped(img, &pos, loc->allow_drop_cmd, &m);
+    for(k = (c + LOCATOR_STEP - 1) / LOCATOR_STEP; k * LOCATOR_STEP < c + n && k * LOCATOR_STEP < loc->nclusters; k++)
+    {
+      loc->entries[k].offset = start;
+      loc->entries[k].cluster = c;
+      loc->entries[k].payload = payload;
+    }
+    if(m.cdata)
+    {
+      loc->used++;
+      payload += m.cmd == CMD_DATA;
+    }
+  }
+
+  loc->scanned[s] = 1;
+}
+
+static struct cluster_locator* get_locator(struct input_image* img)
+{
+  struct cluster_locator* loc;
+
+  if(img->loc)
+    return img->loc;
+
+  if(!img->map)
+    err_exit("Random access to the clusters of %s needs it mapped: give a regular file and do not use --no-mmap or --io-uring\n", img->st->name);
+  if(img->zf)
+    err_exit("Random access to clusters is not possible in a compressed delta\n");
+
+  if((loc = calloc(1, sizeof(*loc))) == NULL ||
+     (loc->entries = malloc(sizeof(*loc->entries) * ((img->ccount + img->bbs_present) / LOCATOR_STEP + 1))) == NULL)
+    perr_exit("failed to allocate cluster locator");
+
+  loc->nclusters = img->ccount + img->bbs_present;
+  loc->allow_drop_cmd = delta_kind(img->hdr.magic) >= 0 && !(delta_kind(img->hdr.magic) & DELTA_COMPRESSED);
+
+  if(!loc->allow_drop_cmd || !load_seek_segments(img, loc))
+  {
+    if((loc->segments = calloc(1, sizeof(*loc->segments))) == NULL)
+      perr_exit("failed to allocate cluster locator");
+    loc->segments[0].offset = img->data_start;
+    loc->nsegments = 1;
+  }
+
+  if((loc->scanned = calloc(loc->nsegments, 1)) == NULL)
+    perr_exit("failed to allocate cluster locator");
+  if(loc->nsegments == 1)
+    scan_segment(img, loc, 0);
+
+  img->keep_mapped = 1;                                   /* random access from now on */
+  img->loc = loc;
+  return loc;
+}
+
+/* the last segment with a value of at most v in the given field */
+static int64_t find_segment(struct cluster_locator* loc, size_t field, int64_t v)
+{
+  int64_t lo = 0, hi = loc->nsegments - 1, mid;
+
+  while(lo < hi)
+  {
+    mid = (lo + hi + 1) / 2;
+    if(*(int64_t*)((char*)&loc->segments[mid] + field) <= v)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
+}
+
+/* the command covering cluster c, returns 0 if there is no such cluster */
+static int locate_command(struct input_image* img, int64_t c, struct mapped_cmd* m)
+{
+  struct cluster_locator* loc = get_locator(img);
+  struct locator_entry* e;
+  size_t pos;
+  int64_t s, first;
+
+  if(c < 0 || c >= loc->nclusters)
+    return 0;
+
+  s = find_segment(loc, offsetof(struct locator_entry, cluster), c);
+  if(!loc->scanned[s])
+    scan_segment(img, loc, s);
+
+  if(c / LOCATOR_STEP * LOCATOR_STEP < loc->segments[s].cluster)
+    e = &loc->segments[s];                                /* entry belongs to the segment before    */
+  else
+    e = &loc->entries[c / LOCATOR_STEP];
+
+  for(pos = e->offset, first = e->cluster; ; )
+  {
+    first += step_mapped(img, &pos, loc->allow_drop_cmd, m);
+    if(c < first)
+      return 1;
+  }
+}
+
+/* payload of cluster c, NULL if it is unused */
+static char* locate_cluster(struct input_image* img, int64_t c)
+{
+  struct mapped_cmd m;
+
+  if(!locate_command(img, c, &m))
+    return NULL;
+  return m.cdata;
+}
+
+/* payload number seq of a delta, which CMD_REF refers to, NULL if there is none */
+static char* locate_payload(struct input_image* img, int64_t seq)
+{
+  struct cluster_locator* loc = get_locator(img);
+  struct locator_entry* e;
+  struct mapped_cmd m;
+  size_t pos;
+  int64_t s, k, lo, hi, end, c, payload;
+
+  s = find_segment(loc, offsetof(struct locator_entry, payload), seq);
+  if(!loc->scanned[s])
+    scan_segment(img, loc, s);
+
+  end = s + 1 < loc->nsegments ? loc->segments[s + 1].cluster : loc->nclusters;
+  e = &loc->segments[s];
+  lo = (e->cluster + LOCATOR_STEP - 1) / LOCATOR_STEP;    /* the entries within the segment */
+  hi = (end - 1) / LOCATOR_STEP;
+  while(lo <= hi)
+  {
+    k = (lo + hi) / 2;
+    if(loc->entries[k].payload <= seq)
+    {
+      e = &loc->entries[k];
+      lo = k + 1;
+    }
+    else
+      hi = k - 1;
+  }
+
+  for(pos = e->offset, c = e->cluster, payload = e->payload; c < loc->nclusters; )
+  {
+    c += step_mapped(img, &pos, loc->allow_drop_cmd, &m);
+    if(m.cmd == CMD_DATA && payload++ == seq)
+      return m.cdata;
+  }
+
+  return NULL;
+}
+
+/* like calling read_next_cluster count times, but ignores the payloads */
+static void skip_clusters(struct input_image* img, int64_t count, int allow_drop_cmd)
+{
+  int64_t n;
+
+  while(count > 0)
+  {
+    if(img->cmd_repeat > 0)
+    {
+      n = img->cmd_repeat < count ? img->cmd_repeat : count;
+      img->cmd_repeat -= n;
+      count -= n;
+    }
+    else if(img->ring)                                    /* the payload numbers must be kept up    */
+    {
+      read_next_cluster(img, allow_drop_cmd);
+      count--;
+    }
+    else
+    {
+      read_next_cmd(img, allow_drop_cmd);
+
+      if(img->cmd == CMD_DATA)
+        skip_payload(img, img->psize);
+      else if(img->cmd == CMD_PATCH)
+        skip_payload(img, patch_size(img->patch_map, img->csize));
+      count--;
+    }
+  }
+}
+
+static void write_pending_cmd(struct output_image* img)
 {
   if(img->cmd != CMD_DATA)
   {
-    int64_t repeat = cpu_to_sle64(img->cmd_repeat);
+    int64_t repeat = cpu_to_sle64(img->cmd_repeat);
+
+    if(img->raw)
+      skip_raw(img, img->cmd_repeat);
+
+    write_output(img, &img->cmd, sizeof(img->cmd));
+    write_output(img, &repeat, sizeof(repeat));
+    end_command(img, img->cmd, img->cmd_repeat);
+      
+//fprintf(stderr, "[%d:%lld]", (int)img->cmd, img->cmd_repeat);
+
+    img->cmd = CMD_DATA;
+    img->cmd_repeat = 0;
+  }
+}
+
+/* the backup boot sector goes to the last sector of the device */
+static void write_raw_bbs(struct output_image* img, char* cdata, uint64_t device_size)
+{
+  write_pending_cmd(img);
+  flush_buffer(img);
+  drain_output(img);
+  
+  if(opt.direct && fcntl(img->fd, F_SETFL, fcntl(img->fd, F_GETFL) & ~O_DIRECT) == -1)
+    perr_exit("fcntl");
+  pwrite_all(img->fd, cdata, NTFS_SECTOR_SIZE, device_size - NTFS_SECTOR_SIZE);
+}
+
+static void write_cmd(struct output_image* img, char cmd, int64_t repeat)
+{
+  if(img->cmd == cmd)
+  {
+    img->cmd_repeat += repeat;
+  }
+  else
+  {
+    write_pending_cmd(img);
+    img->cmd = cmd;
+    img->cmd_repeat = repeat;
+  }
+}
+
+static void write_copy(struct output_image* img, int64_t copy_from)
+{
+  char cmd = CMD_COPY;
+
+  write_pending_cmd(img);
+
+  copy_from = cpu_to_sle64(copy_from);
+  write_output(img, &cmd, sizeof(cmd));
+  write_output(img, &copy_from, sizeof(copy_from));
+  end_command(img, CMD_COPY, 1);
+}
+
+static void write_ref(struct output_image* img, int64_t seq)
+{
+  char cmd = CMD_REF;
+
+  write_pending_cmd(img);
+
+  seq = cpu_to_sle64(seq);
+  write_output(img, &cmd, sizeof(cmd));
+  write_output(img, &seq, sizeof(seq));
+  end_command(img, CMD_REF, 1);
+}
+
+static void write_data(struct output_image* img, char* cdata, uint32_t csize)
+{
+  write_pending_cmd(img);
+
+  write_output(img, &img->cmd, sizeof(img->cmd));
+  write_payload(img, cdata, csize);
+  img->payloads++;
+  end_command(img, CMD_DATA, 1);
+}
+
+/* writes the sectors of cdata set in map as CMD_PATCH */
+static void write_patch(struct output_image* img, char* map, char* cdata, uint32_t csize)
+{
+  char cmd = CMD_PATCH;
+  uint32_t s;
+
+  write_pending_cmd(img);
+
+  write_output(img, &cmd, sizeof(cmd));
+  write_output(img, map, PATCH_MAP_SIZE(csize));
+  for(s = 0; s < csize / NTFS_SECTOR_SIZE; s++)
+    if((map[s >> 3] >> (s & 7)) & 1)
+      write_payload(img, cdata + s * NTFS_SECTOR_SIZE, NTFS_SECTOR_SIZE);
+  end_command(img, CMD_PATCH, 1);
+}
+
+/* 
+ * like write_data, but lets the kernel copy clusters from mapped images,
+ * cdata must be the payload of a CMD_DATA cluster of src 
+ */
+static void copy_data(struct output_image* img, struct input_image* src, char* cdata)
+{
+  size_t offset;
+
+  if(!payload_mapped(src) || img->zf || img->raw || cdata == zero_cluster || cdata == patched_cluster)
+  {
+    write_data(img, cdata, src->csize);
+    return;
+  }
+
+  write_pending_cmd(img);
+
+  offset = cdata - src->map - sizeof(src->cmd);       /* include the command code, it is the    */
+                                                          /* same in the input and output image     */
+  if(img->pt_len > 0 && (img->pt_src != src || img->pt_offset + img->pt_len != offset || img->pt_len >= PASSTHROUGH_MAX))
+    end_passthrough(img);
+
+  if(img->pt_len == 0)
+  {
+    img->pt_src = src;
+    img->pt_offset = offset;
+  }
+
+  img->pt_len += sizeof(src->cmd) + src->csize;
+  img->pos += sizeof(src->cmd) + src->csize;
+  img->payloads++;
+  end_command(img, CMD_DATA, 1);
+}
+
+/*
+ * Equality check for two clusters. Cluster sizes are powers of two of at
+ * least 512 bytes, so the vector kernels work on 256 byte blocks and only 
+ * test for a difference once per block. Which kernel is used is decided
+ * at runtime by init_clusters_equal(), which also picks the matching 
+ * cluster_is_zero() kernel for --zeros.
+ */
+
+#define CMP_BLOCK 256
+
+/* clusters need not be aligned, the compiler turns this into a plain load */
+static inline uint64_t load64(const char* p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int clusters_equal_generic(const char* a, const char* b, size_t n)
+{
+  size_t i, j;
+  uint64_t d;
+
+  for(i = 0; i + CMP_BLOCK <= n; i += CMP_BLOCK)
+  {
+    for(d = 0, j = i; j < i + CMP_BLOCK; j += 32)
+      d |= (load64(a + j) ^ load64(b + j)) | (load64(a + j + 8) ^ load64(b + j + 8)) | 
+           (load64(a + j + 16) ^ load64(b + j + 16)) | (load64(a + j + 24) ^ load64(b + j + 24));
+    if(d)
+      return 0;
+  }
+
+  return memcmp(a + i, b + i, n - i) == 0;
+}
+
+static int cluster_is_zero_generic(const char* a, size_t n)
+{
+  size_t i, j;
+  uint64_t d;
+
+  for(i = 0; i + CMP_BLOCK <= n; i += CMP_BLOCK)
+  {
+    for(d = 0, j = i; j < i + CMP_BLOCK; j += 32)
+      d |= load64(a + j) | load64(a + j + 8) | load64(a + j + 16) | load64(a + j + 24);
+    if(d)
+      return 0;
+  }
+
+  return memcmp(a + i, zero_cluster, n - i) == 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static int clusters_equal_avx2(const char* a, const char* b, size_t n)
+{
+  size_t i, j;
+  __m256i d;
+
+  for(i = 0; i + CMP_BLOCK <= n; i += CMP_BLOCK)
+  {
+    d = _mm256_setzero_si256();
+    for(j = 0; j < CMP_BLOCK; j += sizeof(d))
+      d = _mm256_or_si256(d, _mm256_xor_si256(
+        _mm256_loadu_si256((const __m256i*)(a + i + j)), 
+        _mm256_loadu_si256((const __m256i*)(b + i + j))));
+    if(!_mm256_testz_si256(d, d))
+      return 0;
+  }
+
+  return memcmp(a + i, b + i, n - i) == 0;
+}
+
+__attribute__((target("avx2")))
+static int cluster_is_zero_avx2(const char* a, size_t n)
+{
+  size_t i, j;
+  __m256i d;
+
+  for(i = 0; i + CMP_BLOCK <= n; i += CMP_BLOCK)
+  {
+    d = _mm256_setzero_si256();
+    for(j = 0; j < CMP_BLOCK; j += sizeof(d))
+      d = _mm256_or_si256(d, _mm256_loadu_si256((const __m256i*)(a + i + j)));
+    if(!_mm256_testz_si256(d, d))
+      return 0;
+  }
+
+  return memcmp(a + i, zero_cluster, n - i) == 0;
+}
+
+__attribute__((target("avx512f")))
+static int clusters_equal_avx512(const char* a, const char* b, size_t n)
+{
+  size_t i, j;
+  __m512i d;
+
+  for(i = 0; i + CMP_BLOCK <= n; i += CMP_BLOCK)
+  {
+    d = _mm512_setzero_si512();
+    for(j = 0; j < CMP_BLOCK; j += sizeof(d))
+      d = _mm512_or_si512(d, _mm512_xor_si512(
+        _mm512_loadu_si512(a + i + j), 
+        _mm512_loadu_si512(b + i + j)));
+    if(_mm512_test_epi64_mask(d, d))
+      return 0;
+  }
+
+  return memcmp(a + i, b + i, n - i) == 0;
+}
+
+__attribute__((target("avx512f")))
+static int cluster_is_zero_avx512(const char* a, size_t n)
+{
+  size_t i, j;
+  __m512i d;
+
+  for(i = 0; i + CMP_BLOCK <= n; i += CMP_BLOCK)
+  {
+    d = _mm512_setzero_si512();
+    for(j = 0; j < CMP_BLOCK; j += sizeof(d))
+      d = _mm512_or_si512(d, _mm512_loadu_si512(a + i + j));
+    if(_mm512_test_epi64_mask(d, d))
+      return 0;
+  }
+
+  return memcmp(a + i, zero_cluster, n - i) == 0;
+}
+
+#elif defined(__aarch64__)
+
+static int clusters_equal_neon(const char* a, const char* b, size_t n)
+{
+  size_t i, j;
+  uint8x16_t d;
+
+  for(i = 0; i + CMP_BLOCK <= n; i += CMP_BLOCK)
+  {
+    d = vdupq_n_u8(0);
+    for(j = 0; j < CMP_BLOCK; j += sizeof(d))
+      d = vorrq_u8(d, veorq_u8(
+        vld1q_u8((const uint8_t*)(a + i + j)), 
+        vld1q_u8((const uint8_t*)(b + i + j))));
+    if(vmaxvq_u8(d))
+      return 0;
+  }
+
+  return memcmp(a + i, b + i, n - i) == 0;
+}
+
+static int cluster_is_zero_neon(const char* a, size_t n)
+{
+  size_t i, j;
+  uint8x16_t d;
+
+  for(i = 0; i + CMP_BLOCK <= n; i += CMP_BLOCK)
+  {
+    d = vdupq_n_u8(0);
+    for(j = 0; j < CMP_BLOCK; j += sizeof(d))
+      d = vorrq_u8(d, vld1q_u8((const uint8_t*)(a + i + j)));
+    if(vmaxvq_u8(d))
+      return 0;
+  }
+
+  return memcmp(a + i, zero_cluster, n - i) == 0;
+}
+
+#endif
+
+static int (*clusters_equal)(const char* a, const char* b, size_t n) = clusters_equal_generic;
+static int (*cluster_is_zero)(const char* a, size_t n) = cluster_is_zero_generic;
+
+static void init_clusters_equal()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f"))
+  {
+    clusters_equal = clusters_equal_avx512;
+    cluster_is_zero = cluster_is_zero_avx512;
+  }
+  else if(__builtin_cpu_supports("avx2"))
+  {
+    clusters_equal = clusters_equal_avx2;
+    cluster_is_zero = cluster_is_zero_avx2;
+  }
+#elif defined(__aarch64__)
+  clusters_equal = clusters_equal_neon;
+  cluster_is_zero = cluster_is_zero_neon;
+#endif
+}
+
+/*
+ * 128 bit hash of a cluster, MurmurHash3 x64_128 by Austin Appleby (public 
+ * domain), for the hash tables of '-m' and '-d', which compare the clusters
+ * on a match. len must be a multiple of 16, which cluster sizes always are.
+ */
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static void fast_hash(const char* data, size_t len, char* hash)
+{
+  const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0, h2 = 0, k1, k2;
+  size_t i;
+
+  for(i = 0; i < len; i += 16)
+  {
+    memcpy(&k1, data + i, sizeof(k1));
+    memcpy(&k2, data + i + 8, sizeof(k2));
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  h1 ^= len; h2 ^= len;
+  h1 += h2; h2 += h1;
+  h1 = fmix64(h1); h2 = fmix64(h2);
+  h1 += h2; h2 += h1;
+
+  h1 = cpu_to_sle64(h1);
+  h2 = cpu_to_sle64(h2);
+  memcpy(hash, &h1, sizeof(h1));
+  memcpy(hash + 8, &h2, sizeof(h2));
+}
+
+/*
+ * HASH_SIZE byte BLAKE2b hash of a cluster (RFC 7693), for an index, where
+ * a matching hash is taken for an identical cluster without comparing it.
+ */
+
+static const uint64_t blake2b_iv[8] =
+{
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] =
+{
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+  { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+  {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+  {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+  {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+  { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+  { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+  {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+  { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+static inline uint64_t rotr64(uint64_t x, int r)
+{
+  return (x >> r) | (x << (64 - r));
+}
+
+#define BLAKE2B_G(a, b, c, d, x, y) \
+  do { \
+    v[a] += v[b] + (x); v[d] = rotr64(v[d] ^ v[a], 32); \
+    v[c] += v[d];       v[b] = rotr64(v[b] ^ v[c], 24); \
+    v[a] += v[b] + (y); v[d] = rotr64(v[d] ^ v[a], 16); \
+    v[c] += v[d];       v[b] = rotr64(v[b] ^ v[c], 63); \
+  } while(0)
+
+static void blake2b_compress(uint64_t* h, const char* block, uint64_t t, int last)
+{
+  uint64_t v[16], m[16];
+  const uint8_t* s;
+  int i;
+
+  for(i = 0; i < 16; i++)
+  {
+    memcpy(&m[i], block + 8 * i, sizeof(m[i]));
+    m[i] = sle64_to_cpu(m[i]);
+  }
+  for(i = 0; i < 8; i++)
+  {
+    v[i] = h[i];
+    v[i + 8] = blake2b_iv[i];
+  }
+  v[12] ^= t;
+  if(last)
+    v[14] = ~v[14];
+
+  for(i = 0; i < 12; i++)
+  {
+    s = blake2b_sigma[i];
+    BLAKE2B_G(0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+    BLAKE2B_G(1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+    BLAKE2B_G(2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+    BLAKE2B_G(3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+    BLAKE2B_G(0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+    BLAKE2B_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+    BLAKE2B_G(2, 7,  8, 13, m[s[12]], m[s[13]]);
+    BLAKE2B_G(3, 4,  9, 14, m[s[14]], m[s[15]]);
+  }
+
+  for(i = 0; i < 8; i++)
+    h[i] ^= v[i] ^ v[i + 8];
+}
+
+/* len must be a multiple of 128, which cluster sizes always are */
+static void cluster_hash(const char* data, size_t len, char* hash)
+{
+  uint64_t h[8];
+  size_t i;
+
+  memcpy(h, blake2b_iv, sizeof(h));
+  h[0] ^= 0x01010000 | HASH_SIZE;
+
+  for(i = 0; i + 128 < len; i += 128)
+    blake2b_compress(h, data + i, i + 128, 0);
+  blake2b_compress(h, data + i, len, 1);
+
+  for(i = 0; i < 8; i++)
+    h[i] = cpu_to_sle64(h[i]);
+  memcpy(hash, h, HASH_SIZE);
+}
+
+static void check_headers(struct input_image* img1, struct input_image* img2)
+{
+  if(memcmp(&img1->hdr.cluster_size, &img2->hdr.cluster_size, ((size_t)&((struct image_hdr*)0)->inuse) - IMAGE_MAGIC_SIZE - 2) != 0)
+    err_exit("Input images do not have identical headers\n");
+    
+  if(img1->hdr_extra_len && memcmp(img1->hdr_extra, img2->hdr_extra, img1->hdr_extra_len) != 0)
+    err_exit("Input images do not have identical headers\n");
+}
+
+static void prepare_image_files(
+  char* file1, struct input_image* img1, char* magic1, 
+  char* file2, struct input_image* img2, char* magic2, 
+  char* file3, struct output_image* img3, char* magic3)
+{
+  open_input_image(file1, img1, magic1);
+  open_input_image(file2, img2, magic2);
+  check_headers(img1, img2);
+		
+  create_output_image(file3, img3, magic3, img2);
+}
+
+static void finish_image_files(struct input_image* img1, struct input_image* img2, struct output_image* img3)
+{
+  if(img1->cmd_repeat > 0)
+    err_exit("First input image has %d remaining unused clusters at the end\n", (int)img1->cmd_repeat);
+
+  if(img2->cmd_repeat > 0)
+    err_exit("Second input image has %d remaining unused clusters at the end\n", (int)img2->cmd_repeat);
+
+  write_pending_cmd(img3);
+  if(img3->seek)
+    write_seek_index(img3);
+  if(img3->sums)
+    write_checksums(img3);
+  flush_output(img3);
+  fsync(img3->fd);
+}
+
+  
+
+/* 
+ * skips the part of the current runs of two images both are in, up to max 
+ * clusters, and returns the number of clusters skipped
+ */
+static int64_t common_run(struct input_image* img1, struct input_image* img2, int64_t max)
+{
+  int64_t n = img1->cmd_repeat < img2->cmd_repeat ? img1->cmd_repeat : img2->cmd_repeat;
+
+  if(n > max)
+    n = max;
+
+  img1->cmd_repeat -= n;
+  img2->cmd_repeat -= n;
+  return n;
+}
+
+/*
+ * With --moves, all clusters of the old image are entered into a hash 
+ * table, so that a new cluster which differs from the old one at the same
+ * position can still be found elsewhere in the old image and be written
+ * as CMD_COPY. Only the first of several identical old clusters is kept.
+ */
+
+struct move_entry
+{
+  uint64_t key;    /* part of the cluster hash, 0 for an empty slot */
+  int64_t cluster;
+};
+
+static struct
+{
+  struct input_image* img;
+  uint64_t mask;
+  struct move_entry* entries;
+}
+moves;
+
+static uint64_t move_key(char* cdata, uint32_t csize)
+{
+  char hash[16];
+  uint64_t key;
+
+  fast_hash(cdata, csize, hash);
+  memcpy(&key, hash, sizeof(key));
+  return key ? key : 1;
+}
+
+static void build_move_table(struct input_image* img)
+{
+  struct cluster_locator* loc = get_locator(img);
+  struct move_entry* e;
+  uint64_t size, key;
+  struct mapped_cmd m;
+  size_t pos;
+  int64_t c, n;
+
+  for(size = 1024; size < 2 * (uint64_t)loc->used; size <<= 1)
+    ;
+
+  if((moves.entries = calloc(size, sizeof(*moves.entries))) == NULL)
+    perr_exit("failed to allocate move table");
+  moves.mask = size - 1;
+  moves.img = img;
+
+  for(c = 0, pos = img->data_start; c < loc->nclusters; c += n)
+  {
+    if((n = step_mapped(img, &pos, 0, &m)) > 1 || !m.cdata)
+      continue;
+
+    key = move_key(m.cdata, img->csize);
+    for(e = &moves.entries[key & moves.mask]; e->key && e->key != key; )
+      e = &moves.entries[(e - moves.entries + 1) & moves.mask];
+    if(!e->key)
+    {
+      e->key = key;
+      e->cluster = c;
+    }
+  }
+}
+
+/* number of an old cluster with the same content, -1 if there is none */
+static int64_t find_moved(char* cdata, uint32_t csize)
+{
+  uint64_t key = move_key(cdata, csize);
+  struct move_entry* e;
+
+  for(e = &moves.entries[key & moves.mask]; e->key; e = &moves.entries[(e - moves.entries + 1) & moves.mask])
+    if(e->key == key)
+      return clusters_equal(locate_cluster(moves.img, e->cluster), cdata, csize) ? e->cluster : -1;
+
+  return -1;
+}
+
+/* 
+ * number of an earlier identical payload of the delta, or -1 if there is
+ * none, in which case the payload is remembered as the next one
+ */
+static int64_t find_duplicate(struct payload_ring* ring, char* cdata)
+{
+  struct dedup_entry* e;
+  uint64_t key;
+  char* p;
+
+  key = move_key(cdata, ring->csize);
+  e = &ring->table[key & ring->mask];
+
+  if(e->seq >= 0 && e->key == key && (p = ring_get(ring, e->seq)) != NULL && clusters_equal(p, cdata, ring->csize))
+    return e->seq;
+
+  e->key = key;
+  e->seq = ring->count;
+  ring_add(ring, cdata);
+  return -1;
+}
+
+/* writes a new cluster to a delta, cdata must be from a CMD_DATA cluster of new */
+static void write_delta_data(struct output_image* delta, struct input_image* new, char* cdata)
+{
+  int64_t seq;
+
+  if(delta->ring && (seq = find_duplicate(delta->ring, cdata)) >= 0)
+    write_ref(delta, seq);
+  else
+    copy_data(delta, new, cdata);
+}
+
+/* with --index, old_cdata is the hash of the old cluster */
+static int same_cluster(char* old_cdata, char* new_cdata, uint32_t csize)
+{
+  char hash[HASH_SIZE];
+
+  if(!opt.index)
+    return clusters_equal(old_cdata, new_cdata, csize);
+
+  cluster_hash(new_cdata, csize, hash);
+  return memcmp(old_cdata, hash, HASH_SIZE) == 0;
+}
+
+/* 
+ * compares two clusters sector by sector, sets the bits of the differing
+ * sectors in map and returns their number, or -1 as soon as there are 
+ * too many of them for a CMD_PATCH to be smaller than the whole cluster
+ */
+static int changed_sectors(const char* a, const char* b, uint32_t csize, char* map)
+{
+  uint32_t s, mapsize = PATCH_MAP_SIZE(csize);
+  int n = 0, max = (csize - mapsize - 1) / NTFS_SECTOR_SIZE;
+
+  memset(map, 0, mapsize);
+  for(s = 0; s < csize / NTFS_SECTOR_SIZE; s++)
+  {
+    if(!clusters_equal(a + s * NTFS_SECTOR_SIZE, b + s * NTFS_SECTOR_SIZE, NTFS_SECTOR_SIZE))
+    {
+      if(++n > max)
+        return -1;
+      map[s >> 3] |= 1 << (s & 7);
+    }
+  }
+
+  return n;
+}
+
+/* *copy_from is set for CMD_COPY, map for CMD_PATCH */
+static char delta_cmd(char old_cmd, char* old_cdata, char new_cmd, char* new_cdata, uint32_t csize, int64_t* copy_from, char* map)
+{
+  int sectors = -1;
+
+  if(opt.sectors && old_cmd == CMD_DATA && new_cmd == CMD_DATA)
+  {
+    sectors = changed_sectors(old_cdata, new_cdata, csize, map); /* also tells if they are equal  */
+    if(sectors == 0)
+      return CMD_SKIP;
+  }
+  else if((old_cmd == new_cmd) && (old_cmd == CMD_SKIP || same_cluster(old_cdata, new_cdata, csize))) 
+    return CMD_SKIP;
+
+  if(new_cmd == CMD_SKIP)
+    return CMD_DROP;
+  else if(opt.zeros && cluster_is_zero(new_cdata, csize))
+    return CMD_ZERO;
+  else if(moves.entries && (*copy_from = find_moved(new_cdata, csize)) >= 0)
+    return CMD_COPY;
+  else if(sectors > 0)
+    return CMD_PATCH;
+  else
+    return CMD_DATA;
+}
+
+/*
+ * Pipelined delta creation, used with --threads. One reader thread per
+ * input image splits it into batches of clusters, a pool of worker 
+ * threads compares the batches, and the calling thread writes the 
+ * results in order. Batches live in a ring of slots, the slot of batch n
+ * is reused for batch n + PIPE_SLOTS once its results have been written.
+ * The clusters of an image which is not mapped are copied into a buffer
+ * of its pool, which the reader takes for the batch. The worker puts that
+ * of OLDFILE back after comparing, the writer that of NEWFILE after 
+ * writing, and with --memory-limit there may be fewer of them than slots.
+ * The pages of a mapped image are released by the writer, up to the end
+ * of the last batch written, as the readers are ahead of the batches 
+ * still pointing into them.
+ */
+
+#define BATCH_BYTES (1 << 20)
+#define BATCH_MIN_CLUSTERS 16
+
+struct batch_side
+{
+  char* cmd;
+  char** cdata;   /* into the mapping of the image, or into store */
+  char* store;    /* from the pool of the image, while the batch is in use */
+  size_t map_end; /* map_pos of a mapped image after the batch */
+};
+
+struct batch
+{
+  int64_t seq;    /* number of the batch currently using this slot */
+  int count;
+  int read;       /* number of sides completely read */
+  int compared;
+  struct batch_side side[2];
+  char* result;
+  int64_t* copy_from;
+  char* map;      /* PATCH_MAP_MAX bytes for each cluster */
+};
+
+struct pipeline
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct batch* slots;
+  int nslots;
+  int batch_clusters;
+  int64_t nbatches;
+  int64_t next_compare;
+  struct input_image* img[2];
+  struct buffer_pool* pool[2]; /* NULL for a mapped image */
+  int release[2];              /* mapped images whose pages the writer releases */
+  int64_t ccount;
+};
+
+struct reader_arg
+{
+  struct pipeline* pipe;
+  int side;
+};
+
+static int batch_count(struct pipeline* pipe, int64_t seq)
+{
+  if(seq == pipe->nbatches - 1)
+    return pipe->ccount - seq * pipe->batch_clusters;
+  return pipe->batch_clusters;
+}
+
+static void* pipeline_reader(void* arg)
+{
+  struct pipeline* pipe = ((struct reader_arg*)arg)->pipe;
+  int side = ((struct reader_arg*)arg)->side;
+  struct input_image* img = pipe->img[side];
+  struct batch* b;
+  struct batch_side* bs;
+  int64_t seq, n;
+  int i, changed;
+
+  for(seq = 0; seq < pipe->nbatches; seq++)
+  {
+    b = &pipe->slots[seq % pipe->nslots];
+
+    pthread_mutex_lock(&pipe->lock);
+    while(b->seq != seq)
+      pthread_cond_wait(&pipe->cond, &pipe->lock);
+    pthread_mutex_unlock(&pipe->lock);
+
+    bs = &b->side[side];
+    if(pipe->pool[side])
+      bs->store = pool_get(pipe->pool[side]);
+    for(i = 0; i < b->count; i++)
+    {
+      if(changes.ranges && (n = hint_run(seq * pipe->batch_clusters + i, b->count - i, &changed), !changed))
+      {
+        skip_clusters(img, n, 0);
+        memset(bs->cmd + i, CMD_SKIP, n);
+        i += n - 1;
+        continue;
+      }
+
+      read_next_cluster(img, 0);
+
+      bs->cmd[i] = img->cmd;
+      if(img->cmd != CMD_DATA)
+        continue;
+      if(img->map)                                        /* mapped clusters stay where they are    */
+        bs->cdata[i] = img->cdata;
+      else
+      {
+        bs->cdata[i] = bs->store + (size_t)i * img->csize;
+        memcpy(bs->cdata[i], img->cdata, img->psize);
+      }
+    }
+    bs->map_end = img->map_pos;
+
+    pthread_mutex_lock(&pipe->lock);
+    b->read++;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+  }
+
+  return NULL;
+}
+
+static void* pipeline_worker(void* arg)
+{
+  struct pipeline* pipe = arg;
+  struct batch* b;
+  uint32_t csize = pipe->img[0]->csize;
+  int64_t t;
+  int i;
+
+  for(;;)
+  {
+    pthread_mutex_lock(&pipe->lock);
+    for(;;)
+    {
+      if(pipe->next_compare == pipe->nbatches)
+      {
+        pthread_mutex_unlock(&pipe->lock);
+        return NULL;
+      }
+      b = &pipe->slots[pipe->next_compare % pipe->nslots];
+      if(b->seq == pipe->next_compare && b->read == 2)
+        break;
+      pthread_cond_wait(&pipe->cond, &pipe->lock);
+    }
+    pipe->next_compare++;
+    pthread_mutex_unlock(&pipe->lock);
+
+    t = stats_clock();
+    for(i = 0; i < b->count; i++)
+      b->result[i] = delta_cmd(b->side[0].cmd[i], b->side[0].cdata[i], b->side[1].cmd[i], b->side[1].cdata[i], csize, &b->copy_from[i], b->map + i * PATCH_MAP_MAX);
+    stats_time(&stats.compare_ns, t);
+    if(pipe->pool[0])                                     /* the old clusters are not written       */
+      pool_put(pipe->pool[0], b->side[0].store);
+
+    pthread_mutex_lock(&pipe->lock);
+    b->compared = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+  }
+}
+
+static void run_delta_pipeline(struct input_image* old, struct input_image* new, struct output_image* delta, int64_t ccount)
+{
+  struct pipeline pipe;
+  struct reader_arg rarg[2];
+  pthread_t readers[2];
+  pthread_t* workers;
+  struct batch* b;
+  int64_t seq;
+  int i, j, n;
+
+  memset(&pipe, 0, sizeof(pipe));
+  pthread_mutex_init(&pipe.lock, NULL);
+  pthread_cond_init(&pipe.cond, NULL);
+  pipe.img[0] = old;
+  pipe.img[1] = new;
+  pipe.ccount = ccount;
+  pipe.batch_clusters = BATCH_BYTES / old->csize;
+  if(pipe.batch_clusters < BATCH_MIN_CLUSTERS)
+    pipe.batch_clusters = BATCH_MIN_CLUSTERS;
+  pipe.nbatches = (ccount + pipe.batch_clusters - 1) / pipe.batch_clusters;
+  pipe.nslots = 2 * opt.threads + 2;
+
+  if((pipe.slots = calloc(pipe.nslots, sizeof(*pipe.slots))) == NULL || 
+     (workers = calloc(opt.threads, sizeof(*workers))) == NULL)
+    perr_exit("failed to allocate pipeline");
+
+  for(i = 0; i < pipe.nslots; i++)
+  {
+    b = &pipe.slots[i];
+    b->seq = i;
+    b->count = batch_count(&pipe, i);
+    if((b->result = malloc(pipe.batch_clusters)) == NULL ||
+       (b->copy_from = malloc(pipe.batch_clusters * sizeof(*b->copy_from))) == NULL ||
+       (b->map = malloc(pipe.batch_clusters * PATCH_MAP_MAX)) == NULL)
+      perr_exit("failed to allocate pipeline");
+    for(j = 0; j < 2; j++)
+    {
+      b->side[j].cmd = malloc(pipe.batch_clusters);
+      b->side[j].cdata = malloc(pipe.batch_clusters * sizeof(char*));
+      if(!b->side[j].cmd || !b->side[j].cdata)
+        perr_exit("failed to allocate pipeline");
+    }
+  }
+
+  n = pipe.nslots;                                        /* buffers for each image not mapped      */
+  if(opt.memory_limit && opt.memory_limit / 2 / ((size_t)pipe.batch_clusters * old->csize) < (size_t)n)
+    n = opt.memory_limit / 2 / ((size_t)pipe.batch_clusters * old->csize);
+  if(n < 1)
+    n = 1;
+  for(j = 0; j < 2; j++)
+    if(!pipe.img[j]->map)
+      pipe.pool[j] = create_pool((size_t)pipe.batch_clusters * old->csize, n);
+
+  for(j = 0; j < 2; j++)
+    if((pipe.release[j] = pipe.img[j]->map && !pipe.img[j]->keep_mapped))
+      pipe.img[j]->keep_mapped = 1;                       /* not by the readers, see above          */
+
+  for(j = 0; j < 2; j++)
+  {
+    rarg[j].pipe = &pipe;
+    rarg[j].side = j;
+    if(pthread_create(&readers[j], NULL, pipeline_reader, &rarg[j]) != 0)
+      err_exit("failed to create reader thread\n");
+  }
+  for(i = 0; i < opt.threads; i++)
+    if(pthread_create(&workers[i], NULL, pipeline_worker, &pipe) != 0)
+      err_exit("failed to create worker thread\n");
+
+  for(seq = 0; seq < pipe.nbatches; seq++)
+  {
+    b = &pipe.slots[seq % pipe.nslots];
+
+    pthread_mutex_lock(&pipe.lock);
+    while(!b->compared)
+      pthread_cond_wait(&pipe.cond, &pipe.lock);
+    pthread_mutex_unlock(&pipe.lock);
+
+    for(i = 0; i < b->count; i++)
+    {
+      switch(b->result[i])
+      {
+        case CMD_SKIP: write_cmd(delta, CMD_SKIP, 1); break;
+        case CMD_DROP: write_cmd(delta, CMD_DROP, 1); break;
+        case CMD_ZERO: write_cmd(delta, CMD_ZERO, 1); break;
+        case CMD_COPY: write_copy(delta, b->copy_from[i]); break;
+        case CMD_PATCH: write_patch(delta, b->map + i * PATCH_MAP_MAX, b->side[1].cdata[i], new->csize); break;
+        default:       write_delta_data(delta, new, b->side[1].cdata[i]);
+      }
+    }
+
+    if(pipe.pool[1])
+      pool_put(pipe.pool[1], b->side[1].store);
+    for(j = 0; j < 2; j++)
+      if(pipe.release[j] && b->side[j].map_end - pipe.img[j]->map_released >= MAP_RELEASE_STEP)
+        release_mapped(pipe.img[j], b->side[j].map_end);
+
+    pthread_mutex_lock(&pipe.lock);
+    b->seq += pipe.nslots;
+    b->read = 0;
+    b->compared = 0;
+    b->count = batch_count(&pipe, b->seq);
+    pthread_cond_broadcast(&pipe.cond);
+    pthread_mutex_unlock(&pipe.lock);
+  }
+
+  for(j = 0; j < 2; j++)
+    pthread_join(readers[j], NULL);
+  for(i = 0; i < opt.threads; i++)
+    pthread_join(workers[i], NULL);
+  for(j = 0; j < 2; j++)
+    if(pipe.release[j])
+      pipe.img[j]->keep_mapped = 0;
+
+  for(i = 0; i < pipe.nslots; i++)
+  {
+    b = &pipe.slots[i];
+    for(j = 0; j < 2; j++)
+    {
+      free(b->side[j].cmd);
+      free(b->side[j].cdata);
+    }
+    free(b->result);
+    free(b->copy_from);
+    free(b->map);
+  }
+  for(j = 0; j < 2; j++)
+    destroy_pool(pipe.pool[j]);
+  free(pipe.slots);
+  free(workers);
+  pthread_cond_destroy(&pipe.cond);
+  pthread_mutex_destroy(&pipe.lock);
+}
+
+/* 
+ * writes the command for the current clusters of old and new, n is the 
+ * number of clusters if both are unused and 1 otherwise
+ */
+static void write_delta_cmd(struct output_image* delta, struct input_image* old, struct input_image* new, int64_t n)
+{
+  int64_t copy_from, t;
+  char map[PATCH_MAP_MAX], cmd;
+
+  t = stats_clock();
+  cmd = delta_cmd(old->cmd, old->cdata, new->cmd, new->cdata, old->csize, &copy_from, map);
+  stats_time(&stats.compare_ns, t);
+  switch(cmd)
+  {
+    case CMD_SKIP: 
+      write_cmd(delta, CMD_SKIP, n); 
+      break;
+    case CMD_DROP: 
+      write_cmd(delta, CMD_DROP, 1); 
+      break;
+    case CMD_ZERO: 
+      write_cmd(delta, CMD_ZERO, 1); 
+      break;
+    case CMD_COPY:
+      write_copy(delta, copy_from);
+      break;
+    case CMD_PATCH:
+      write_patch(delta, map, new->cdata, new->csize);
+      break;
+    default:       
+      write_delta_data(delta, new, new->cdata);
+  }
+}
+
+static void create_delta(char* file1, char* file2, char* file3)
+{
+  int64_t pos, ccount, n;
+  struct input_image old, new;
+  struct output_image delta;
+  int changed;
+  
+  if(opt.resume)
+  {
+    check_resume('d', file1, &file2, 1, file3);
+    load_checkpoint();
+  }
+
+  if(opt.device)                                          /* NEWFILE is the volume itself           */
+  {
+    open_input_image(file1, &old, opt.index ? INDEX_MAGIC : IMAGE_MAGIC);
+    open_device_image(file2, &new, &old);
+    check_headers(&old, &new);
+    create_output_image(file3, &delta, delta_magic(opt.moves), &new);
+  }
+  else
+    prepare_image_files(file1, &old, opt.index ? INDEX_MAGIC : IMAGE_MAGIC, file2, &new, IMAGE_MAGIC, file3, &delta, delta_magic(opt.moves));
+
+  ccount = old.ccount;                                    /* if both files have the new format with */
+  if(old.bbs_present == 1 && new.bbs_present == 1)        /* the backup boot sector at the end, we  */
+    ccount += 1;                                          /* just have one block more to compare    */
+
+  if(opt.changed)
+    load_changes(opt.changed, opt.changed_bitmap, old.ccount);
+  else if(opt.sample > 1)
+    sample_changes(opt.sample, old.ccount);
+
+  if(opt.moves)
+  {
+    if(opt.index)
+      err_exit("Moved clusters cannot be detected with an index\n");
+    build_move_table(&old);
+  }
+
+  if(opt.dedup)
+    delta.ring = create_ring(new.csize, new.map != NULL, 1);
+
+  if(opt.seek_step)
+    start_seek_index(&delta, opt.seek_step);
+
+  if(opt.threads > 1)
+    run_delta_pipeline(&old, &new, &delta, ccount);
+  else for(pos = opt.resume ? start_resume('d', &old, &new, 1, &delta) : 0; pos < ccount; pos += n)
+  {
+    if(opt.resume && pos >= resume.next)
+      write_checkpoint(pos, &old, &new, &delta);
+
+    if(changes.ranges && (n = hint_run(pos, ccount - pos, &changed), !changed))
+    {
+      skip_clusters(&old, n, 0);
+      skip_clusters(&new, n, 0);
+      write_cmd(&delta, CMD_SKIP, n);
+      continue;
+    }
+
+    read_next_cluster(&old, 0);
+    read_next_cluster(&new, 0);
+
+    n = 1;
+    if(old.cmd == CMD_SKIP && new.cmd == CMD_SKIP)        /* both unused, take the rest of the     */
+      n += common_run(&old, &new, ccount - pos - 1);      /* shorter run along at once              */
+    write_delta_cmd(&delta, &old, &new, n);
+  }
+  
+  if(old.bbs_present == 1 && new.bbs_present == 0)        /* if only the first file has the new     */
+  {                                                       /* format with the backup boot sector at  */
+    read_next_cluster(&old, 0);                           /* the end, we just discard this block    */
+  }
+  else if(old.bbs_present == 0 && new.bbs_present == 1)   /* if only the second file has the new    */
+  {                                                       /* format with the backup boot sector at  */
+    read_next_cluster(&new, 0);                           /* the end, we have to keep this block    */
+    write_delta_data(&delta, &new, new.cdata);
+  }
+  
+  finish_image_files(&old, &new, &delta);
+  if(opt.resume)
+    finish_resume();
+}
+
+/* an output file must not be one of the inputs, it is truncated before they are read */
+static void check_not_input(char* file, struct input_image* img)
+{
+  struct stat st1, st2;
+
+  if(stat(file, &st1) == 0 && fstat(img->fd, &st2) == 0 && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+    err_exit("%s is also an input file\n", file);
+}
+
+/*
+ * rebase reads NEWFILE from stdin, as ntfsclone writes it, and at the same 
+ * time writes it to NEWFILE and the reverse delta REVERSE, with which 
+ * OLDFILE can be patched back from NEWFILE. Both inputs are read just once,
+ * so the latest backup can be kept as a full dump and the older ones as 
+ * reverse deltas without reading the images again. REVERSE is written 
+ * with the same options as a delta, except for --moves, as NEWFILE is not
+ * there yet to be looked through first.
+ */
+static void rebase_image(char* file1, char* file2, char* file3)
+{
+  int64_t pos, ccount, n, copy_from, t;
+  struct input_image old, new;
+  struct output_image copy, reverse;
+  char map[PATCH_MAP_MAX], cmd;
+
+  if(opt.moves)
+    err_exit("Moved clusters cannot be detected while rebasing\n");
+
+  open_input_image(file1, &old, IMAGE_MAGIC);
+  open_input_image("-", &new, IMAGE_MAGIC);
+  check_headers(&old, &new);
+  check_not_input(file2, &old);
+  check_not_input(file3, &old);
+
+  create_output_image(file2, &copy, IMAGE_MAGIC, &new);
+  create_output_image(file3, &reverse, delta_magic(opt.moves), &old);
+
+  ccount = old.ccount;
+  if(old.bbs_present == 1 && new.bbs_present == 1)
+    ccount += 1;
+
+  if(opt.dedup)
+    reverse.ring = create_ring(old.csize, old.map != NULL, 1);
+
+  if(opt.seek_step)
+    start_seek_index(&reverse, opt.seek_step);
+
+  for(pos = 0; pos < ccount; pos += n)
+  {
+    read_next_cluster(&new, 0);
+    read_next_cluster(&old, 0);
+
+    n = 1;
+    t = stats_clock();                                    /* the other way round than for delta     */
+    cmd = delta_cmd(new.cmd, new.cdata, old.cmd, old.cdata, old.csize, &copy_from, map);
+    stats_time(&stats.compare_ns, t);
+    if(cmd == CMD_SKIP && new.cmd == CMD_SKIP)
+      n += common_run(&new, &old, ccount - pos - 1);
+
+    if(new.cmd == CMD_SKIP)                               /* NEWFILE as it is                       */
+      write_cmd(&copy, CMD_SKIP, n);
+    else
+      write_data(&copy, new.cdata, new.csize);
+
+    switch(cmd)
+    {
+      case CMD_SKIP: 
+        write_cmd(&reverse, CMD_SKIP, n); 
+        break;
+      case CMD_DROP: 
+        write_cmd(&reverse, CMD_DROP, 1); 
+        break;
+      case CMD_ZERO: 
+        write_cmd(&reverse, CMD_ZERO, 1); 
+        break;
+      case CMD_PATCH:
+        write_patch(&reverse, map, old.cdata, old.csize);
+        break;
+      default:       
+        write_delta_data(&reverse, &old, old.cdata);
+    }
+  }
+
+  if(old.bbs_present == 1 && new.bbs_present == 0)        /* only OLDFILE has the backup boot       */
+  {                                                       /* sector, REVERSE has to keep it         */
+    read_next_cluster(&old, 0);
+    write_delta_data(&reverse, &old, old.cdata);
+  }
+  else if(old.bbs_present == 0 && new.bbs_present == 1)   /* only NEWFILE has it, it is just copied */
+  {
+    read_next_cluster(&new, 0);
+    write_data(&copy, new.cdata, new.csize);
+  }
+
+  write_pending_cmd(&copy);
+  flush_output(&copy);
+  fsync(copy.fd);
+  finish_image_files(&new, &old, &reverse);
+}
+
+/*
+ * batch makes the deltas of several images against the same OLDFILE or
+ * INDEX, reading it only once. Each cluster of it is compared with that of
+ * every NEWFILE in turn, and each delta is written as delta would write 
+ * it. The lanes are stepped together in the calling thread, a run of 
+ * unused clusters is taken along at once only as far as it is unused in
+ * all images.
+ */
+static void create_batch(char* file1, char** files, int count)
+{
+  int64_t pos, n;
+  struct input_image old, * new;
+  struct output_image* delta;
+  int i, j;
+
+  if(opt.threads > 1 && opt.compress < 0)
+    err_exit("The deltas of a batch are made in one thread, --threads only works with -z\n");
+
+  for(i = 0; i < count; i++)
+    for(j = 0; j < i; j++)
+      if(strcmp(files[2 * i], "-") == 0 && strcmp(files[2 * j], "-") == 0)
+        err_exit("You cannot select stdin for two input files\n");
+      else if(strcmp(files[2 * i + 1], "-") == 0 && strcmp(files[2 * j + 1], "-") == 0)
+        err_exit("You cannot select stdout for two deltas\n");
+
+  if((new = calloc(count, sizeof(*new))) == NULL || (delta = calloc(count, sizeof(*delta))) == NULL)
+    perr_exit("failed to allocate batch");
+
+  open_input_image(file1, &old, opt.index ? INDEX_MAGIC : IMAGE_MAGIC);
+  for(i = 0; i < count; i++)
+  {
+    if(strcmp(files[2 * i], "-") == 0 && strcmp(file1, "-") == 0)
+      err_exit("You cannot select stdin for both input files\n");
+    open_input_image(files[2 * i], &new[i], IMAGE_MAGIC);
+    check_headers(&old, &new[i]);
+  }
+  for(i = 0; i < count; i++)                              /* before any of them is truncated        */
+  {
+    check_not_input(files[2 * i + 1], &old);
+    for(j = 0; j < count; j++)
+      check_not_input(files[2 * i + 1], &new[j]);
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    create_output_image(files[2 * i + 1], &delta[i], delta_magic(opt.moves), &new[i]);
+    if(opt.dedup)
+      delta[i].ring = create_ring(new[i].csize, new[i].map != NULL, 1);
+    if(opt.seek_step)
+      start_seek_index(&delta[i], opt.seek_step);
+  }
+  stats.total *= count;                                   /* every lane counts its clusters         */
+
+  if(opt.moves)
+  {
+    if(opt.index)
+      err_exit("Moved clusters cannot be detected with an index\n");
+    build_move_table(&old);
+  }
+
+  for(pos = 0; pos < old.ccount; pos += n)
+  {
+    read_next_cluster(&old, 0);
+    for(i = 0; i < count; i++)
+      read_next_cluster(&new[i], 0);
+
+    n = 1;
+    if(old.cmd == CMD_SKIP)                               /* the shortest of the unused runs        */
+    {
+      n += old.cmd_repeat < old.ccount - pos - 1 ? old.cmd_repeat : old.ccount - pos - 1;
+      for(i = 0; i < count; i++)
+        if(new[i].cmd != CMD_SKIP)
+          n = 1;
+        else if(new[i].cmd_repeat + 1 < n)
+          n = new[i].cmd_repeat + 1;
+      old.cmd_repeat -= n - 1;
+      for(i = 0; i < count; i++)
+        new[i].cmd_repeat -= new[i].cmd == CMD_SKIP ? n - 1 : 0;
+    }
+
+    for(i = 0; i < count; i++)
+      write_delta_cmd(&delta[i], &old, &new[i], n);
+  }
+
+  if(old.bbs_present)                                     /* the backup boot sector, for the lanes  */
+    read_next_cluster(&old, 0);                           /* which have it as well                  */
+  for(i = 0; i < count; i++)
+  {
+    if(new[i].bbs_present)
+    {
+      read_next_cluster(&new[i], 0);
+      if(old.bbs_present)
+        write_delta_cmd(&delta[i], &old, &new[i], 1);
+      else
+        write_delta_data(&delta[i], &new[i], new[i].cdata);
+    }
+    finish_image_files(&old, &new[i], &delta[i]);
+  }
+}
+
+/*
+ * Chains of deltas, the oldest first, each one made against the image
+ * the one before it leads to. A cluster is decided by the newest delta
+ * which does not say CMD_SKIP for it, or by the image the first delta 
+ * was made against if all of them do.
+ */
+
+/* 
+ * the delta below newest, or -1 for the base, which has the whole cluster 
+ * the CMD_PATCH clusters of the deltas above it up to newest apply to
+ */
+static int patch_base(struct input_image* deltas, int newest)
+{
+  int i = newest;
+
+  while(i >= 0 && (deltas[i].cmd == CMD_SKIP || deltas[i].cmd == CMD_PATCH))
+    i--;
+
+  return i;
+}
+
+/* applies the CMD_PATCH clusters of the deltas above base up to newest to patched_cluster */
+static char* apply_patches(struct input_image* deltas, int base, int newest)
+{
+  int i;
+
+  for(i = base + 1; i <= newest; i++)
+    if(deltas[i].cmd == CMD_PATCH)
+      patch_sectors(patched_cluster, deltas[i].patch_map, deltas[i].cdata, deltas[i].csize);
+
+  return patched_cluster;
+}
+
+/* 
+ * reads the next run of at most max clusters from all deltas of the chain,
+ * and from base, if given, returns its length. *newest is set to the delta
+ * deciding the run, or to -1 if it is unchanged, and then base holds it.
+ * Runs are longer than 1 cluster for runs of CMD_SKIP, CMD_DROP or 
+ * CMD_ZERO only. Base is not read where a delta decides, unless the 
+ * cluster is a CMD_PATCH of it.
+ */
+static int64_t next_chain_run(struct input_image* base, struct input_image* deltas, int count, int64_t max, int* newest)
+{
+  int64_t n = max - 1;
+  int i, j, k;
+
+  for(i = 0; i < count; i++)
+    read_next_cluster(&deltas[i], 1);
+
+  for(i = count - 1; i >= 0 && deltas[i].cmd == CMD_SKIP; i--)
+    ;
+  k = i >= 0 && deltas[i].cmd == CMD_PATCH ? patch_base(deltas, i) : i;
+
+  for(j = i < 0 ? 0 : i; j < count; j++)                  /* single clusters have no repeat left   */
+    if(deltas[j].cmd_repeat < n) 
+      n = deltas[j].cmd_repeat;
+
+  if(base && k < 0)
+  {
+    read_next_cluster(base, 0);
+    if(base->cmd_repeat < n)
+      n = base->cmd_repeat;
+    base->cmd_repeat -= n;
+  }
+  else if(base)
+    skip_clusters(base, n + 1, 0);
+
+  for(j = 0; j < count; j++)
+  {
+    if(j < k)
+      skip_clusters(&deltas[j], n, 1);                    /* overridden by a newer delta            */
+    else
+      deltas[j].cmd_repeat -= n;
+  }
+
+  *newest = i;
+  return n + 1;
+}
+
+/* 
+ * the backup boot sector is only there in the deltas leading to an image
+ * of the new format, and can only be CMD_SKIP if the older image has it.
+ * Like next_chain_run(), but only meaningful if the last delta has it.
+ */
+static int next_chain_bbs(struct input_image* deltas, int count)
+{
+  int i;
+
+  for(i = 0; i < count; i++)
+    if(deltas[i].bbs_present)
+      read_next_cluster(&deltas[i], 1);
+
+  if(!deltas[count - 1].bbs_present)                      /* not in the final image at all          */
+    return -1;
+
+  for(i = count - 1; i >= 0 && deltas[i].bbs_present && (deltas[i].cmd == CMD_SKIP || deltas[i].cmd == CMD_PATCH); i--)
+    ;
+
+  if(i >= 0 && !deltas[i].bbs_present)
+    err_exit("Delta %d keeps a backup boot sector its old image does not have\n", i + 2);
+
+  for(i = count - 1; i >= 0 && deltas[i].cmd == CMD_SKIP; i--)
+    ;
+
+  return i;
+}
+
+/* stdin_used is set if stdin is already taken by another input */
+static void open_chain(char** files, int count, struct input_image** deltas, int stdin_used)
+{
+  int i;
+
+  if((*deltas = calloc(count, sizeof(**deltas))) == NULL)
+    perr_exit("failed to allocate delta chain");
+
+  for(i = 0; i < count; i++)
+  {
+    if(strcmp(files[i], "-") == 0 && stdin_used++)
+      err_exit("You cannot select stdin for more than one input file\n");
+
+    open_input_image(files[i], &(*deltas)[i], DELTA_MAGIC);
+    if(i > 0)
+      check_headers(&(*deltas)[i - 1], &(*deltas)[i]);
+    if((*deltas)[i].refs)                                 /* the payloads CMD_REF refers back to    */
+      (*deltas)[i].ring = create_ring((*deltas)[i].csize, payload_mapped(&(*deltas)[i]), 0);
+  }
+}
+
+static void finish_chain(struct input_image* deltas, int count)
+{
+  int i;
+
+  for(i = 0; i < count; i++)
+    if(deltas[i].cmd_repeat > 0)
+      err_exit("Delta %d has %d remaining clusters at the end\n", i + 1, (int)deltas[i].cmd_repeat);
+}
+
+/* 
+ * reads the next run of at most max clusters of the patched image from old
+ * and the chain of deltas. Returns the length of the run, *src is the 
+ * image the cluster comes from, or NULL for a run of unused clusters, 
+ * *cdata its payload. Only runs of zero clusters have a *src and are 
+ * longer than 1 cluster.
+ */
+static int64_t patch_source(struct input_image* old, struct input_image* deltas, int newest, int64_t n, struct input_image** src, char** cdata)
+{
+  struct input_image* d = newest < 0 ? old : &deltas[newest];
+  int base;
+
+  if(d->cmd == CMD_SKIP || d->cmd == CMD_DROP)
+  {
+    *src = NULL;
+    return n;
+  }
+
+  if(d->cmd == CMD_PATCH)                                 /* the cluster it changes comes first     */
+  {
+    base = patch_base(deltas, newest);
+    if(patch_source(old, deltas, base, 1, src, cdata), !*src)
+      err_exit("Delta %d patches a cluster which is not used in its old image\n", newest + 1);
+    memcpy(patched_cluster, *cdata, d->csize);
+    *src = d;
+    *cdata = apply_patches(deltas, base, newest);
+    return 1;
+  }
+
+  if(d->cmd == CMD_COPY)
+  {
+    if(newest > 0)                                        /* would need the intermediate image      */
+      err_exit("Only the first delta of a chain can have moved clusters\n");
+    if((*cdata = locate_cluster(old, d->cmd_arg)) == NULL)
+      err_exit("Delta copies cluster %lld, which is not used in the old image\n", (long long)d->cmd_arg);
+    *src = old;
+    return 1;
+  }
+
+  *src = d;
+  *cdata = d->cdata;
+  return n;
+}
+
+static int64_t next_patch_run(struct input_image* old, struct input_image* deltas, int count, int64_t max, struct input_image** src, char** cdata)
+{
+  int64_t n;
+  int newest;
+
+  n = next_chain_run(old, deltas, count, max, &newest);
+  return patch_source(old, deltas, newest, n, src, cdata);
+}
+
+/* 
+ * the same for the backup boot sector after the last cluster, returns 0
+ * if there is none in the patched image, which then has the old format 
+ */
+static int next_patch_bbs(struct input_image* old, struct input_image* deltas, int count, struct input_image** src, char** cdata)
+{
+  int newest = next_chain_bbs(deltas, count);
+
+  if(old->bbs_present)
+    read_next_cluster(old, 0);
+
+  if(!deltas[count - 1].bbs_present)
+    return 0;
+  if(newest < 0 && !old->bbs_present)
+    err_exit("Delta 1 keeps a backup boot sector the old image does not have\n");
+
+  return patch_source(old, deltas, newest, 1, src, cdata);
+}
+
+/*
+ * Parallel patching, used with --threads if both input images are mapped
+ * and the output is seekable. Since the command codes are the same in the
+ * delta and the patched image, the position of every cluster in the
+ * output is known from the command codes alone. So the calling thread 
+ * just scans the command streams and cuts the output into jobs, each a 
+ * list of extents which are either a run header or spans of clusters 
+ * copied from one of the inputs. Worker threads assemble the jobs and 
+ * pwrite() them in whatever order they finish. Everything a job copies 
+ * has been read after the job before it was started, so once all jobs up
+ * to one are written, the pages of the inputs before where they had got
+ * when it was started are released.
+ */
+
+#define JOB_BYTES (8 << 20)
+#define JOB_EXTENTS 4096
+
+struct extent
+{
+  struct input_image* src;     /* NULL for a run header, zero or patched clusters */
+  size_t offset;               /* in the mapping of src */
+  size_t len;
+  uint32_t zeros;              /* cluster size of a span of zero clusters */
+  char* data;                  /* record of a patched cluster, freed when written */
+  char run[1 + sizeof(int64_t)];
+};
+
+struct patch_job
+{
+  int64_t seq;                 /* number of the job currently using this slot */
+  int ready;
+  off_t out_offset;
+  size_t bytes;
+  int count;
+  size_t* map_start;           /* map_pos of each of the images released when the job was started */
+  struct extent ext[JOB_EXTENTS];
+};
+
+struct patch_plan
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct patch_job* slots;
+  int nslots;
+  int64_t next_take;
+  int64_t njobs;               /* -1 until planning is complete */
+  struct patch_job* job;       /* the job being planned */
+  off_t out_offset;
+  int64_t skip_repeat;         /* length of the pending run of unused clusters */
+  struct output_image* out;
+  struct input_image** img;    /* inputs whose pages are released behind the jobs written */
+  int nimg;
+  int64_t next_done;           /* all jobs before this one have been written */
+};
+
+/* 
+ * releases the inputs up to where they were when the last of the jobs
+ * written without a gap before it was started, before its slot is reused
+ */
+static void release_done_jobs(struct patch_plan* plan)
+{
+  struct patch_job* job = NULL;
+  int i;
+
+  while(plan->next_done < plan->job->seq && plan->slots[plan->next_done % plan->nslots].seq != plan->next_done)
+    job = &plan->slots[plan->next_done++ % plan->nslots];
+
+  if(job)
+    for(i = 0; i < plan->nimg; i++)                       /* not once CMD_COPY reads it at random   */
+      if(!plan->img[i]->loc && job->map_start[i] - plan->img[i]->map_released >= MAP_RELEASE_STEP)
+        release_mapped(plan->img[i], job->map_start[i]);
+}
+
+static void start_job(struct patch_plan* plan)
+{
+  int i;
+
+  plan->job->out_offset = plan->out_offset;
+  plan->job->bytes = 0;
+  plan->job->count = 0;
+  for(i = 0; i < plan->nimg; i++)
+    plan->job->map_start[i] = plan->img[i]->map_pos;
+}
+
+static void submit_job(struct patch_plan* plan)
+{
+  struct patch_job* job = plan->job;
+
+  pthread_mutex_lock(&plan->lock);
+  job->ready = 1;
+  pthread_cond_broadcast(&plan->cond);
+  plan->job = &plan->slots[(job->seq + 1) % plan->nslots];
+  while(plan->job->seq != job->seq + 1 || plan->job->ready)
+    pthread_cond_wait(&plan->cond, &plan->lock);
+  release_done_jobs(plan);
+  pthread_mutex_unlock(&plan->lock);
+
+  start_job(plan);
+}
+
+static struct extent* add_extent(struct patch_plan* plan, struct input_image* src, size_t offset, size_t len)
+{
+  struct patch_job* job = plan->job;
+  struct extent* e = job->count > 0 ? &job->ext[job->count - 1] : NULL;
+
+  if(e && src && e->src == src && e->offset + e->len == offset)
+    e->len += len;                                        /* continues the last span */
+  else
+  {
+    if(job->count == JOB_EXTENTS || job->bytes >= JOB_BYTES)
+    {
+      submit_job(plan);
+      job = plan->job;
+    }
+    e = &job->ext[job->count++];
+    e->src = src;
+    e->offset = offset;
+    e->len = len;
+    e->zeros = 0;
+    e->data = NULL;
+  }
+
+  job->bytes += len;
+  plan->out_offset += len;
+  return e;
+}
+
+static void plan_pending_run(struct patch_plan* plan)
+{
+  struct extent* e;
+  int64_t repeat;
+
+  if(plan->skip_repeat > 0)
+  {
+    if(stats.enabled)
+      stats_command(CMD_SKIP, plan->skip_repeat);
+    repeat = cpu_to_sle64(plan->skip_repeat);
+    e = add_extent(plan, NULL, 0, sizeof(e->run));
+    e->run[0] = CMD_SKIP;
+    memcpy(e->run + 1, &repeat, sizeof(repeat));
+    plan->skip_repeat = 0;
+  }
+}
+
+/* a CMD_ZERO cluster of the delta, it has no payload to copy from */
+static void plan_zero(struct patch_plan* plan, uint32_t csize)
+{
+  struct patch_job* job;
+  struct extent* e;
+
+  plan_pending_run(plan);
+
+  job = plan->job;
+  e = job->count > 0 ? &job->ext[job->count - 1] : NULL;
+  if(e && !e->src && e->zeros == csize && job->bytes < JOB_BYTES)
+  {
+    e->len += 1 + csize;
+    job->bytes += 1 + csize;
+    plan->out_offset += 1 + csize;
+  }
+  else
+    add_extent(plan, NULL, 0, 1 + csize)->zeros = csize;
+}
+
+/* a CMD_PATCH cluster of the delta, which has been assembled in patched_cluster */
+static void plan_patched(struct patch_plan* plan, uint32_t csize)
+{
+  struct extent* e;
+
+  plan_pending_run(plan);
+
+  e = add_extent(plan, NULL, 0, 1 + csize);
+  if((e->data = malloc(1 + csize)) == NULL)
+    perr_exit("failed to allocate patched cluster");
+  e->data[0] = CMD_DATA;
+  memcpy(e->data + 1, patched_cluster, csize);
+}
+
+static void plan_cluster(struct patch_plan* plan, struct input_image* src, char* cdata, int64_t repeat)
+{
+  if(src && stats.enabled)
+    stats_command(CMD_DATA, repeat);
+
+  if(!src)
+    plan->skip_repeat += repeat;
+  else if(cdata == patched_cluster)
+    plan_patched(plan, src->csize);
+  else if(cdata == zero_cluster)
+    while(repeat-- > 0)
+      plan_zero(plan, src->csize);
+  else
+  {
+    plan_pending_run(plan);
+    add_extent(plan, src, cdata - src->map - sizeof(src->cmd), sizeof(src->cmd) + src->csize);
+  }
+}
+
+static void* patch_worker(void* arg)
+{
+  struct patch_plan* plan = arg;
+  struct patch_job* job;
+  struct extent* e;
+  char* buf;
+  size_t len, done;
+  loff_t src_off, out_off;
+  int64_t t;
+  ssize_t n;
+  int i, copy_range = plan->out->copy_mode == COPY_RANGE;
+
+  if((buf = malloc(JOB_BYTES + PASSTHROUGH_MIN)) == NULL)
+    perr_exit("failed to allocate job buffer");
+
+  for(;;)
+  {
+    pthread_mutex_lock(&plan->lock);
+    for(;;)
+    {
+      job = &plan->slots[plan->next_take % plan->nslots];
+      if(job->seq == plan->next_take && job->ready)
+        break;
+      if(plan->njobs == plan->next_take)
+      {
+        pthread_mutex_unlock(&plan->lock);
+        free(buf);
+        return NULL;
+      }
+      pthread_cond_wait(&plan->cond, &plan->lock);
+    }
+    plan->next_take++;
+    pthread_mutex_unlock(&plan->lock);
+
+    out_off = job->out_offset;
+    len = 0;
+    for(i = 0; i < job->count; i++)
+    {
+      e = &job->ext[i];
+      if(e->zeros)
+      {
+        for(done = 0; done < e->len; done += 1 + e->zeros)
+        {
+          if(len + 1 + e->zeros > JOB_BYTES + PASSTHROUGH_MIN)
+          {
+            pwrite_all(plan->out->fd, buf, len, out_off);
+            out_off += len;
+            len = 0;
+          }
+          buf[len] = CMD_DATA;
+          memcpy(buf + len + 1, zero_cluster, e->zeros);
+          len += 1 + e->zeros;
+        }
+        continue;
+      }
+      if(!e->src)
+      {
+        if(len + e->len > JOB_BYTES + PASSTHROUGH_MIN)
+        {
+          pwrite_all(plan->out->fd, buf, len, out_off);
+          out_off += len;
+          len = 0;
+        }
+        memcpy(buf + len, e->data ? e->data : e->run, e->len);
+        len += e->len;
+        free(e->data);
+        continue;
+      }
+      if(e->len < PASSTHROUGH_MIN || !copy_range)
+      {
+        if(len + e->len > JOB_BYTES + PASSTHROUGH_MIN)
+        {
+          pwrite_all(plan->out->fd, buf, len, out_off);
+          out_off += len;
+          len = 0;
+        }
+        if(e->len <= JOB_BYTES)
+        {
+          memcpy(buf + len, e->src->map + e->offset, e->len);
+          len += e->len;
+        }
+        else
+        {
+          pwrite_all(plan->out->fd, e->src->map + e->offset, e->len, out_off);
+          out_off += e->len;
+        }
+        continue;
+      }
+
+      pwrite_all(plan->out->fd, buf, len, out_off);       /* long spans are left to the kernel      */
+      out_off += len;
+      len = 0;
+
+      for(src_off = e->offset; src_off < (loff_t)(e->offset + e->len); )
+      {
+        t = stats_clock();
+        n = copy_file_range(e->src->fd, &src_off, plan->out->fd, &out_off, e->offset + e->len - src_off, 0);
+        stats_time(&stats.write_ns, t);
+        if(n > 0)
+        {
+          stats_written(n);
+          continue;
+        }
+        if(n == 0)
+          err_exit("copy: unexpected end of file\n");
+        if(errno == EAGAIN || errno == EINTR)
+          continue;
+        if(errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)
+          perr_exit("copy");
+        copy_range = 0;
+        pwrite_all(plan->out->fd, e->src->map + src_off, e->offset + e->len - src_off, out_off);
+        out_off += e->offset + e->len - src_off;
+        break;
+      }
+    }
+    pwrite_all(plan->out->fd, buf, len, out_off);
+
+    pthread_mutex_lock(&plan->lock);
+    job->ready = 0;
+    job->seq += plan->nslots;
+    pthread_cond_broadcast(&plan->cond);
+    pthread_mutex_unlock(&plan->lock);
+  }
+}
+
+static void run_patch_parallel(struct input_image* old, struct input_image* deltas, int count, struct output_image* new)
+{
+  struct patch_plan plan;
+  pthread_t* workers;
+  struct input_image* src;
+  int64_t pos, n;
+  char* cdata;
+  int i;
+
+  flush_output(new);                                      /* the header */
+
+  memset(&plan, 0, sizeof(plan));
+  pthread_mutex_init(&plan.lock, NULL);
+  pthread_cond_init(&plan.cond, NULL);
+  plan.out = new;
+  plan.njobs = -1;
+  plan.nslots = 2 * opt.threads + 2;
+  if((plan.out_offset = lseek(new->fd, 0, SEEK_CUR)) == (off_t)-1)
+    perr_exit("lseek");
+
+  if((plan.slots = calloc(plan.nslots, sizeof(*plan.slots))) == NULL || 
+     (workers = calloc(opt.threads, sizeof(*workers))) == NULL)
+    perr_exit("failed to allocate job queue");
+  if((plan.img = calloc(count + 1, sizeof(*plan.img))) == NULL)
+    perr_exit("failed to allocate job queue");
+  for(i = -1; i < count; i++)                             /* unless random access needs them anyway */
+  {                                                       /* or CMD_REF refers back into them       */
+    src = i < 0 ? old : &deltas[i];
+    if(!src->keep_mapped && !src->refs)
+      plan.img[plan.nimg++] = src;
+    src->keep_mapped = 1;                                 /* the workers still need the pages       */
+  }
+
+  for(i = 0; i < plan.nslots; i++)
+  {
+    plan.slots[i].seq = i;
+    if((plan.slots[i].map_start = malloc((plan.nimg + 1) * sizeof(size_t))) == NULL)
+      perr_exit("failed to allocate job queue");
+  }
+  plan.job = &plan.slots[0];
+  start_job(&plan);
+
+  for(i = 0; i < opt.threads; i++)
+    if(pthread_create(&workers[i], NULL, patch_worker, &plan) != 0)
+      err_exit("failed to create worker thread\n");
+
+  for(pos = 0; pos < old->ccount; pos += n)
+  {
+    n = next_patch_run(old, deltas, count, old->ccount - pos, &src, &cdata);
+    plan_cluster(&plan, src, cdata, n);
+  }
+
+  if(next_patch_bbs(old, deltas, count, &src, &cdata))
+    plan_cluster(&plan, src, cdata, 1);
+
+  plan_pending_run(&plan);
+
+  pthread_mutex_lock(&plan.lock);
+  plan.job->ready = 1;
+  plan.njobs = plan.job->seq + 1;
+  pthread_cond_broadcast(&plan.cond);
+  pthread_mutex_unlock(&plan.lock);
+
+  for(i = 0; i < opt.threads; i++)
+    pthread_join(workers[i], NULL);
+  for(i = 0; i < plan.nimg; i++)
+    if(!plan.img[i]->loc)
+      plan.img[i]->keep_mapped = 0;
+
+  for(i = 0; i < plan.nslots; i++)
+    free(plan.slots[i].map_start);
+  free(plan.slots);
+  free(plan.img);
+  free(workers);
+  pthread_cond_destroy(&plan.cond);
+  pthread_mutex_destroy(&plan.lock);
+}
+
+static void write_patch_run(struct output_image* new, struct input_image* src, char* cdata, int64_t n)
+{
+  if(!src)
+    write_cmd(new, CMD_SKIP, n);
+  else while(n-- > 0)
+    copy_data(new, src, cdata);
+}
+
+/* patches OLDFILE with a chain of count deltas in one pass */
+static void apply_patch(char *file1, char** files, int count, char* file3)
+{
+  struct input_image* src;
+  char* cdata;
+  int64_t pos, n;
+  int i, mapped = 1;
+  struct input_image old, * deltas;
+  struct output_image new;
+  
+  if(opt.resume)
+  {
+    check_resume('p', file1, files, count, file3);
+    load_checkpoint();
+  }
+
+  open_input_image(file1, &old, IMAGE_MAGIC);
+  open_chain(files, count, &deltas, strcmp(file1, "-") == 0);
+  check_headers(&old, &deltas[0]);
+  if(deltas[0].moves && !old.map)                         /* before the output is created           */
+    err_exit("CMD_COPY needs OLDFILE mapped: give a regular file and do not use --no-mmap or --io-uring\n");
+  if(opt.raw)
+    create_raw_output(file3, &new, &deltas[count - 1]);
+  else
+    create_output_image(file3, &new, IMAGE_MAGIC, &deltas[count - 1]);
+
+  for(i = 0; i < count; i++)
+    mapped &= payload_mapped(&deltas[i]);
+
+  if(opt.threads > 1 && old.map && mapped && new.seekable && !new.raw && !opt.resume)
+    run_patch_parallel(&old, deltas, count, &new);
+  else
+  {
+    if((pos = opt.resume ? start_resume('p', &old, deltas, count, &new) : 0) > 0)
+      for(i = 0; i < count; i++)                          /* for the payloads CMD_REF refers to     */
+        skip_clusters(&deltas[i], pos, 1);
+
+    for(; pos < old.ccount; pos += n)
+    {
+      if(opt.resume && pos >= resume.next)
+        write_checkpoint(pos, &old, NULL, &new);
+      n = next_patch_run(&old, deltas, count, old.ccount - pos, &src, &cdata);
+      write_patch_run(&new, src, cdata, n);
+    }
+
+    if(next_patch_bbs(&old, deltas, count, &src, &cdata))
+    {
+      if(!new.raw)
+        write_patch_run(&new, src, cdata, 1);
+      else if(src)
+        write_raw_bbs(&new, cdata, sle64_to_cpu(deltas[count - 1].hdr.device_size));
+    }
+  }
+  
+  finish_chain(deltas, count);
+  finish_image_files(&old, &deltas[count - 1], &new);
+  if(opt.resume)
+    finish_resume();
+}
+
+/* 
+ * the CMD_PATCH clusters of the deltas above base up to newest become
+ * one CMD_PATCH of the image before the chain, or are applied to the 
+ * cluster base has
+ */
+static void write_chain_patch(struct output_image* merged, struct input_image* deltas, int base, int newest)
+{
+  char map[PATCH_MAP_MAX];
+  uint32_t csize = deltas[newest].csize, j;
+  int i;
+
+  if(base < 0)
+  {
+    memset(map, 0, sizeof(map));
+    for(i = 0; i <= newest; i++)
+      if(deltas[i].cmd == CMD_PATCH)
+        for(j = 0; j < PATCH_MAP_SIZE(csize); j++)
+          map[j] |= deltas[i].patch_map[j];
+    write_patch(merged, map, apply_patches(deltas, base, newest), csize);
+  }
+  else if(deltas[base].cmd == CMD_DATA)
+  {
+    memcpy(patched_cluster, deltas[base].cdata, csize);
+    if(merged->ring)                                      /* the ring may only keep a pointer to it */
+      ring_skip(merged->ring);
+    write_data(merged, apply_patches(deltas, base, newest), csize);
+  }
+  else if(deltas[base].cmd == CMD_COPY)
+    err_exit("Delta %d patches a moved cluster, which cannot be merged\n", newest + 1);
+  else
+    err_exit("Delta %d patches a cluster which is not used in its old image\n", newest + 1);
+}
+
+static void write_chain_run(struct output_image* merged, struct input_image* deltas, int newest, int64_t n)
+{
+  struct input_image* d = newest < 0 ? NULL : &deltas[newest];
+
+  if(!d)
+    write_cmd(merged, CMD_SKIP, n);
+  else if(d->cmd == CMD_PATCH)
+    write_chain_patch(merged, deltas, patch_base(deltas, newest), newest);
+  else if(d->cmd == CMD_DROP)
+    write_cmd(merged, CMD_DROP, n);
+  else if(d->cmd == CMD_COPY)
+  {
+    if(newest > 0)                                        /* would need the intermediate image      */
+      err_exit("Only the first delta of a chain can be merged with moved clusters\n");
+    write_copy(merged, d->cmd_arg);
+  }
+  else if(d->cdata == zero_cluster)
+    write_cmd(merged, CMD_ZERO, n);
+  else
+    write_delta_data(merged, d, d->cdata);
+}
+
+static void merge_deltas(char** files, int count, char* file_out)
+{
+  struct input_image* deltas;
+  struct output_image merged;
+  int64_t pos, n;
+  int i, newest, mapped = 1;
+
+  open_chain(files, count, &deltas, 0);
+  create_output_image(file_out, &merged, delta_magic(deltas[0].moves), &deltas[count - 1]);
+
+  for(i = 0; i < count; i++)
+    mapped &= payload_mapped(&deltas[i]);
+  if(opt.dedup)
+    merged.ring = create_ring(deltas[0].csize, mapped, 1);
+
+  if(opt.seek_step)
+    start_seek_index(&merged, opt.seek_step);
+
+  for(pos = 0; pos < deltas[0].ccount; pos += n)
+  {
+    n = next_chain_run(NULL, deltas, count, deltas[0].ccount - pos, &newest);
+    write_chain_run(&merged, deltas, newest, n);
+  }
+
+  newest = next_chain_bbs(deltas, count);
+  if(deltas[count - 1].bbs_present)
+    write_chain_run(&merged, deltas, newest, 1);
+
+  finish_chain(deltas, count);
+  finish_image_files(&deltas[0], &deltas[count - 1], &merged);
+}
+
+/*
+ * Read-only mount of the NTFS volume an image and a chain of deltas lead
+ * to, assembled on demand. The volume appears as the only file of the 
+ * mount point and can be loop mounted itself. The kernel FUSE protocol 
+ * is spoken directly on /dev/fuse, so this needs no library, but root
+ * privileges. Every cluster read is looked up through the chain with the
+ * cluster locators, unused clusters read as zero.
+ */
+
+#define VOLUME_INO 2
+#define VOLUME_NAME "volume"
+#define MOUNT_MAX_READ (128 << 10)
+#define MOUNT_TIMEOUT 3600 /* seconds the kernel may cache attributes */
+
+struct volume
+{
+  struct input_image* old;
+  struct input_image* deltas;
+  int count;
+  uint32_t csize;
+  int64_t nclusters;
+  uint64_t size;
+  char* bbs;       /* the backup boot sector in the last sector, NULL if there is none */
+  time_t mtime;
+  int fd;
+};
+
+static char* mount_point;
+
+/* payload of cluster c of the image the chain leads to, NULL if it is unused */
+static char* chain_cluster(struct input_image* old, struct input_image* deltas, int count, int64_t c)
+{
+  struct mapped_cmd m;
+  char* cdata;
+  int i;
+
+  for(i = count - 1; i >= 0; i--)
+  {
+    if(!locate_command(&deltas[i], c, &m))
+      return NULL;
+
+    switch(m.cmd)
+    {
+      case CMD_DATA: return m.cdata;
+      case CMD_ZERO: return zero_cluster;
+      case CMD_DROP: return NULL;
+      case CMD_REF:
+        if((cdata = locate_payload(&deltas[i], m.arg)) == NULL)
+          err_exit("Invalid back reference in delta\n");
+        return cdata;
+      case CMD_COPY:                                      /* a cluster of the image before */
+        c = m.arg;
+        break;
+      case CMD_PATCH:
+        if((cdata = chain_cluster(old, deltas, i, c)) == NULL)
+          err_exit("Delta %d patches a cluster which is not used in its old image\n", i + 1);
+        if(cdata != patched_cluster)                      /* unless patched below already          */
+          memcpy(patched_cluster, cdata, deltas[i].csize);
+        patch_sectors(patched_cluster, m.map, m.cdata, deltas[i].csize);
+        return patched_cluster;
+    }
+  }
+
+  return locate_cluster(old, c);
+}
+
+/* 
+ * the backup boot sector of the image the chain leads to, which follows
+ * its last cluster, as next_patch_bbs finds it, or NULL if it has none
+ */
+static char* chain_bbs(struct input_image* old, struct input_image* deltas, int count)
+{
+  static char bbs[NTFS_SECTOR_SIZE];
+  char* cdata;
+
+  if(!(count > 0 ? deltas[count - 1].bbs_present : old->bbs_present))
+    return NULL;
+  if((cdata = chain_cluster(old, deltas, count, old->ccount)) == NULL)
+    err_exit("The chain keeps a backup boot sector an image before it does not have\n");
+  memcpy(bbs, cdata, NTFS_SECTOR_SIZE);
+  return bbs;
+}
+
+static void volume_read(struct volume* vol, uint64_t offset, size_t size, char* buf)
+{
+  uint64_t c, bbs_start = vol->size - NTFS_SECTOR_SIZE;
+  size_t start, n;
+  char* cdata;
+
+  for(; size > 0; offset += n, buf += n, size -= n)
+  {
+    if(vol->bbs && offset >= bbs_start)                   /* where --raw puts it as well            */
+    {
+      n = size;
+      memcpy(buf, vol->bbs + (offset - bbs_start), n);
+      continue;
+    }
+
+    c = offset / vol->csize;
+    start = offset % vol->csize;
+    n = vol->csize - start < size ? vol->csize - start : size;
+    if(vol->bbs && offset + n > bbs_start)
+      n = bbs_start - offset;
+
+    if(c < (uint64_t)vol->nclusters && (cdata = chain_cluster(vol->old, vol->deltas, vol->count, c)) != NULL)
+      memcpy(buf, cdata + start, n);
+    else
+      memset(buf, 0, n);
+  }
+}
+
+static void fuse_reply(struct volume* vol, uint64_t unique, int error, void* data, size_t len)
+{
+  struct fuse_out_header out;
+  struct iovec iov[2];
+
+  out.len = sizeof(out) + (error ? 0 : len);
+  out.error = -error;
+  out.unique = unique;
+  iov[0].iov_base = &out;
+  iov[0].iov_len = sizeof(out);
+  iov[1].iov_base = data;
+  iov[1].iov_len = error ? 0 : len;
+
+  if(writev(vol->fd, iov, 2) == -1 && errno != ENOENT)    /* ENOENT: the request was interrupted   */
+    perr_exit("write to /dev/fuse");
+}
+
+static void volume_attr(struct volume* vol, uint64_t ino, struct fuse_attr* attr)
+{
+  memset(attr, 0, sizeof(*attr));
+  attr->ino = ino;
+  attr->atime = attr->mtime = attr->ctime = vol->mtime;
+  attr->blksize = vol->csize;
+
+  if(ino == FUSE_ROOT_ID)
+  {
+    attr->mode = S_IFDIR | 0555;
+    attr->nlink = 2;
+  }
+  else
+  {
+    attr->mode = S_IFREG | 0444;
+    attr->nlink = 1;
+    attr->size = vol->size;
+    attr->blocks = (vol->size + 511) / 512;
+  }
+}
+
+static void volume_readdir(struct volume* vol, struct fuse_in_header* in, struct fuse_read_in* arg, char* buf)
+{
+  static const char* names[] = { ".", "..", VOLUME_NAME };
+  struct fuse_dirent* d;
+  size_t len = 0, size;
+  uint64_t i;
+
+  for(i = arg->offset; i < sizeof(names) / sizeof(*names); i++)
+  {
+    size = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + strlen(names[i]));
+    if(len + size > arg->size)
+      break;
+
+    d = (struct fuse_dirent*)(buf + len);
+    memset(d, 0, size);
+    d->ino = i == 2 ? VOLUME_INO : FUSE_ROOT_ID;
+    d->off = i + 1;
+    d->namelen = strlen(names[i]);
+    d->type = i == 2 ? DT_REG : DT_DIR;
+    memcpy(d->name, names[i], d->namelen);
+    len += size;
+  }
+
+  fuse_reply(vol, in->unique, 0, buf, len);
+}
+
+/* answers one request, returns 0 once the file system is unmounted */
+static int volume_request(struct volume* vol, char* req, char* buf)
+{
+  struct fuse_in_header* in = (struct fuse_in_header*)req;
+  void* arg = req + sizeof(*in);
+  struct fuse_init_in* init_in = arg;
+  struct fuse_init_out init_out;
+  struct fuse_entry_out entry;
+  struct fuse_attr_out attr;
+  struct fuse_open_out open_out;
+  struct fuse_read_in* read_in = arg;
+  struct fuse_statfs_out statfs;
+
+  switch(in->opcode)
+  {
+    case FUSE_INIT:
+      if(init_in->major < 7)
+        err_exit("Kernel FUSE protocol %u.%u is too old\n", init_in->major, init_in->minor);
+      memset(&init_out, 0, sizeof(init_out));
+      init_out.major = FUSE_KERNEL_VERSION;
+      init_out.minor = FUSE_KERNEL_MINOR_VERSION;
+      init_out.max_readahead = init_in->max_readahead;
+      init_out.max_write = 4096;
+      init_out.time_gran = 1000000000;
+      fuse_reply(vol, in->unique, 0, &init_out, init_in->minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(init_out));
+      break;
+    case FUSE_LOOKUP:
+      if(in->nodeid != FUSE_ROOT_ID || strcmp(arg, VOLUME_NAME) != 0)
+      {
+        fuse_reply(vol, in->unique, ENOENT, NULL, 0);
+        break;
+      }
+      memset(&entry, 0, sizeof(entry));
+      entry.nodeid = VOLUME_INO;
+      entry.generation = 1;
+      entry.entry_valid = entry.attr_valid = MOUNT_TIMEOUT;
+      volume_attr(vol, VOLUME_INO, &entry.attr);
+      fuse_reply(vol, in->unique, 0, &entry, sizeof(entry));
+      break;
+    case FUSE_GETATTR:
+      memset(&attr, 0, sizeof(attr));
+      attr.attr_valid = MOUNT_TIMEOUT;
+      volume_attr(vol, in->nodeid, &attr.attr);
+      fuse_reply(vol, in->unique, 0, &attr, sizeof(attr));
+      break;
+    case FUSE_OPEN:
+    case FUSE_OPENDIR:
+      if(in->opcode == FUSE_OPEN && (((struct fuse_open_in*)arg)->flags & O_ACCMODE) != O_RDONLY)
+      {
+        fuse_reply(vol, in->unique, EROFS, NULL, 0);
+        break;
+      }
+      memset(&open_out, 0, sizeof(open_out));
+      open_out.open_flags = FOPEN_KEEP_CACHE;
+      fuse_reply(vol, in->unique, 0, &open_out, sizeof(open_out));
+      break;
+    case FUSE_READ:
+      if(read_in->offset >= vol->size)
+        read_in->size = 0;
+      else if(read_in->size > vol->size - read_in->offset)
+        read_in->size = vol->size - read_in->offset;
+      if(read_in->size > MOUNT_MAX_READ)
+        read_in->size = MOUNT_MAX_READ;
+      volume_read(vol, read_in->offset, read_in->size, buf);
+      fuse_reply(vol, in->unique, 0, buf, read_in->size);
+      break;
+    case FUSE_READDIR:
+      if(read_in->size > MOUNT_MAX_READ)
+        read_in->size = MOUNT_MAX_READ;
+      volume_readdir(vol, in, read_in, buf);
+      break;
+    case FUSE_STATFS:
+      memset(&statfs, 0, sizeof(statfs));
+      statfs.st.blocks = vol->nclusters;
+      statfs.st.bsize = statfs.st.frsize = vol->csize;
+      statfs.st.files = 1;
+      statfs.st.namelen = 255;
+      fuse_reply(vol, in->unique, 0, &statfs, sizeof(statfs));
+      break;
+    case FUSE_RELEASE:
+    case FUSE_RELEASEDIR:
+    case FUSE_FLUSH:
+    case FUSE_ACCESS:
+      fuse_reply(vol, in->unique, 0, NULL, 0);
+      break;
+    case FUSE_FORGET:                                     /* these get no reply */
+    case FUSE_BATCH_FORGET:
+    case FUSE_INTERRUPT:
+      break;
+    case FUSE_DESTROY:
+      fuse_reply(vol, in->unique, 0, NULL, 0);
+      return 0;
+    default:
+      fuse_reply(vol, in->unique, ENOSYS, NULL, 0);
+  }
+
+  return 1;
+}
+
+static void unmount_volume(int sig)
+{
+  (void)sig;
+  umount2(mount_point, MNT_DETACH);
+}
+
+static void mount_volume(char* file1, char** files, int count, char* dir)
+{
+  struct volume vol;
+  struct input_image old;
+  struct stat st;
+  char options[128];
+  char* req, * buf;
+  ssize_t len;
+  int i;
+
+  memset(&vol, 0, sizeof(vol));
+  open_input_image(file1, &old, IMAGE_MAGIC);
+  vol.old = &old;
+  vol.count = count;
+  if(count > 0)
+  {
+    open_chain(files, count, &vol.deltas, strcmp(file1, "-") == 0);
+    check_headers(&old, &vol.deltas[0]);
+  }
+
+  get_locator(&old);                                      /* fail early, not on the first read      */
+  for(i = 0; i < count; i++)
+    get_locator(&vol.deltas[i]);
+
+  vol.csize = old.csize;
+  vol.nclusters = old.ccount;
+  vol.size = sle64_to_cpu(old.hdr.device_size);
+  vol.bbs = chain_bbs(&old, vol.deltas, count);
+  if(fstat(count > 0 ? vol.deltas[count - 1].fd : old.fd, &st) == 0)
+    vol.mtime = st.st_mtime;
+
+  if((req = malloc(FUSE_MIN_READ_BUFFER + MOUNT_MAX_READ + 1)) == NULL || (buf = malloc(MOUNT_MAX_READ)) == NULL)
+    perr_exit("failed to allocate request buffer");
+
+  if((vol.fd = open("/dev/fuse", O_RDWR)) == -1)
+    perr_exit("failed to open /dev/fuse");
+
+  snprintf(options, sizeof(options), "fd=%d,rootmode=%o,user_id=%u,group_id=%u,max_read=%d", 
+    vol.fd, S_IFDIR, (unsigned)getuid(), (unsigned)getgid(), MOUNT_MAX_READ);
+  if(mount("ntfscloneimgdelta", dir, "fuse.ntfscloneimgdelta", MS_RDONLY | MS_NOSUID | MS_NODEV, options) == -1)
+    perr_exit("failed to mount");
+
+  mount_point = dir;
+  signal(SIGINT, unmount_volume);
+  signal(SIGTERM, unmount_volume);
+
+  for(;;)
+  {
+    if((len = read(vol.fd, req, FUSE_MIN_READ_BUFFER + MOUNT_MAX_READ)) == -1)
+    {
+      if(errno == ENODEV)                                 /* unmounted */
+        break;
+      if(errno == EINTR || errno == EAGAIN || errno == ENOENT)
+        continue;
+      perr_exit("read from /dev/fuse");
+    }
+    if((size_t)len < sizeof(struct fuse_in_header))
+      err_exit("Short request from /dev/fuse\n");
+    req[len] = '\0';                                      /* names are terminated anyway            */
+    if(!volume_request(&vol, req, buf))
+      break;
+  }
+
+  close(vol.fd);
+}
+
+static void create_index(char* file1, char* file2)
+{
+  int64_t pos, ccount, n;
+  struct input_image img;
+  struct output_image index;
+  char hash[HASH_SIZE];
+
+  open_input_image(file1, &img, IMAGE_MAGIC);
+  create_output_image(file2, &index, INDEX_MAGIC, &img);
+
+  ccount = img.ccount + img.bbs_present;
+
+  for(pos = 0; pos < ccount; pos += n)
+  {
+    read_next_cluster(&img, 0);
+
+    n = 1;
+    if(img.cmd == CMD_SKIP)
+    {
+      n += img.cmd_repeat < ccount - pos - 1 ? img.cmd_repeat : ccount - pos - 1;
+      img.cmd_repeat -= n - 1;
+      write_cmd(&index, CMD_SKIP, n);
+    }
+    else
+    {
+      cluster_hash(img.cdata, img.csize, hash);
+      write_data(&index, hash, HASH_SIZE);
+    }
+  }
+
+  if(img.cmd_repeat > 0)
+    err_exit("Input image has %d remaining unused clusters at the end\n", (int)img.cmd_repeat);
+
+  write_pending_cmd(&index);
+  flush_output(&index);
+  fsync(index.fd);
+}
+
+/* reads everything after the current position, up to the end of the file */
+static char* read_rest(struct input_image* img, size_t* len)
+{
+  char* rest = NULL;
+  size_t size = 0;
+  ssize_t n;
+
+  if(img->map)
+  {
+    *len = img->map_size - img->map_pos;
+    return img->map + img->map_pos;
+  }
+
+  for(*len = 0; ; img->buf_len = n, img->buf_pos = 0)
+  {
+    n = img->buf_len - img->buf_pos;
+    if(*len + n > size)
+    {
+      size = 2 * (*len + n);
+      if((rest = realloc(rest, size)) == NULL)
+        perr_exit("failed to allocate trailer");
+    }
+    memcpy(rest + *len, img->buf + img->buf_pos, n);
+    *len += n;
+
+    if(img->ur)
+      n = read_uring(img);
+    else
+      while((n = read(img->fd, img->buf, opt.buffer_size)) < 0)
+        if(errno != EAGAIN && errno != EINTR)
+          perr_exit("read");
+    if(n == 0)
+      break;
+    img->st->bytes += n;
+  }
+
+  return rest;
+}
+
+/* the clusters in use in OLDFILE or INDEX, and how many up to the backup boot sector */
+static unsigned char* load_base_usage(struct input_image* old, int64_t* inuse)
+{
+  int64_t ccount = old->ccount + old->bbs_present, pos, n;
+  unsigned char* used;
+
+  if((used = calloc(ccount / 8 + 1, 1)) == NULL)
+    perr_exit("failed to allocate cluster bitmap");
+
+  for(*inuse = 0, pos = 0; pos < ccount; pos += n)
+  {
+    read_next_cmd(old, 0);
+    n = 1;
+    if(old->cmd == CMD_SKIP)
+    {
+      n += old->cmd_repeat;
+      old->cmd_repeat = 0;
+      if(n > ccount - pos)
+        err_exit("Input image has %d remaining unused clusters at the end\n", (int)(n - ccount + pos));
+    }
+    else
+    {
+      skip_input(old, old->psize);                        /* only the command codes are needed      */
+      used[pos >> 3] |= 1 << (pos & 7);
+      *inuse += pos < old->ccount;
+    }
+  }
+
+  return used;
+}
+
+static int64_t count_used(unsigned char* bitmap, int64_t c, int64_t end)
+{
+  int64_t n, count = 0;
+
+  for(; c < end; c += n)
+  {
+    n = bitmap_run(bitmap, c, end);
+    if(cluster_in_use(bitmap, c))
+      count += n;
+  }
 
-    write_all(img->fd, &img->cmd, sizeof(img->cmd));
-    write_all(img->fd, &repeat, sizeof(repeat));
-      
-//fprintf(stderr, "[%d:%lld]", (int)img->cmd, img->cmd_repeat);
+  return count;
+}
 
-    img->cmd = CMD_DATA;
-    img->cmd_repeat = 0;
+/* the seek index has to be all there is between the last cluster and the checksums */
+static void check_seek_index(char* buf, size_t len, int64_t ccount, int64_t commands_end, int64_t payloads)
+{
+  struct seek_tail tail;
+  struct seek_entry e, prev;
+  int64_t i;
+
+  if(len < sizeof(tail) || (memcpy(&tail, buf + len - sizeof(tail), sizeof(tail)), memcmp(tail.magic, SEEK_MAGIC, IMAGE_MAGIC_SIZE) != 0) ||
+     sle64_to_cpu(tail.count) < 1 || (uint64_t)sle64_to_cpu(tail.count) != (len - sizeof(tail)) / sizeof(e) || (len - sizeof(tail)) % sizeof(e))
+    err_exit("Delta has data after the last cluster\n");
+
+  memset(&prev, 0, sizeof(prev));
+  for(i = 0; i < sle64_to_cpu(tail.count); i++)
+  {
+    memcpy(&e, buf + i * sizeof(e), sizeof(e));
+    e.cluster = sle64_to_cpu(e.cluster);
+    e.offset = sle64_to_cpu(e.offset);
+    e.payload = sle64_to_cpu(e.payload);
+    if((i == 0 ? e.cluster != 0 : e.cluster <= prev.cluster || e.offset <= prev.offset || e.payload < prev.payload) ||
+       e.cluster >= ccount || e.offset >= commands_end || e.payload > payloads)
+      err_exit("Invalid seek index in delta\n");
+    prev = e;
   }
 }
 
-static void write_cmd(struct output_image* img, char cmd)
+/*
+ * verify reads a delta once from start to end. It checks that the 
+ * commands are valid and cover the volume exactly, and that the delta
+ * matches the checksums at its end, if it was written with --checksums.
+ * With OLDFILE or its INDEX, it also checks that the delta fits that
+ * image: the same volume, clusters only copied and patched where OLDFILE
+ * has them, and as many clusters in use in the end as the header of the
+ * delta says. Of OLDFILE nothing but the command codes is read.
+ */
+static void verify_delta(char* file1, char* file2)
 {
-  if(img->cmd == cmd)
+  struct input_image old, delta;
+  struct checksums* sums = create_checksums();
+  unsigned char* used = NULL;
+  int64_t ccount, pos, n, end, commands_end, payloads = 0, inuse = 0, old_inuse = 0, count, bad = 0, i;
+  size_t len, ck;
+  uint32_t size;
+  char* rest;
+
+  open_input_image(file2, &delta, DELTA_MAGIC);
+  add_checksums(sums, &delta.hdr, sizeof(delta.hdr));     /* read before there were checksums       */
+  add_checksums(sums, delta.hdr_extra, delta.hdr_extra_len);
+  delta.sums = sums;
+  ccount = delta.ccount + delta.bbs_present;
+
+  if(file1)
+  {
+    open_input_image(file1, &old, opt.index ? INDEX_MAGIC : IMAGE_MAGIC);
+    check_headers(&old, &delta);
+    used = load_base_usage(&old, &old_inuse);
+  }
+
+  for(pos = 0; pos < ccount; pos += n)
+  {
+    read_next_cmd(&delta, 1);
+
+    n = 1;
+    switch(delta.cmd)
+    {
+      case CMD_SKIP:
+      case CMD_DROP:
+      case CMD_ZERO:
+        n += delta.cmd_repeat;
+        delta.cmd_repeat = 0;
+        if(n > ccount - pos)
+          err_exit("Delta has %lld clusters beyond the end of the volume\n", (long long)(n - ccount + pos));
+        break;
+      case CMD_DATA:
+        skip_payload(&delta, delta.csize);
+        payloads++;
+        break;
+      case CMD_COPY:
+        if(delta.cmd_arg < 0 || delta.cmd_arg >= delta.ccount || (used && !cluster_in_use(used, delta.cmd_arg)))
+          err_exit("Invalid cluster %lld copied to cluster %lld in delta\n", (long long)delta.cmd_arg, (long long)pos);
+        break;
+      case CMD_REF:
+        if(delta.cmd_arg < 0 || delta.cmd_arg >= payloads || delta.cmd_arg < payloads - DEDUP_WINDOW / delta.csize)
+          err_exit("Invalid back reference in delta at cluster %lld\n", (long long)pos);
+        break;
+      case CMD_PATCH:
+        if((size = patch_size(delta.patch_map, delta.csize)) == 0 || (used && !cluster_in_use(used, pos)))
+          err_exit("Invalid patch of cluster %lld in delta\n", (long long)pos);
+        skip_payload(&delta, size);
+        break;
+    }
+
+    end = pos + n < delta.ccount ? pos + n : delta.ccount;  /* not the backup boot sector            */
+    if(used && pos < end)
+      inuse += delta.cmd == CMD_SKIP ? count_used(used, pos, end) : delta.cmd == CMD_DROP ? 0 : end - pos;
+  }
+
+  if(delta.zf && (delta.zf->cmd_pos < delta.zf->cmd_len || delta.zf->payload_pos < delta.zf->payload_len))
+    err_exit("Delta has data after the last cluster\n");
+
+  delta.sums = NULL;                                      /* the trailers are read as they are      */
+  commands_end = sums->pos;
+  rest = read_rest(&delta, &len);
+  ck = checksums_size(rest, len);
+  if(len > ck)
+    check_seek_index(rest, len - ck, ccount, commands_end, payloads);
+  add_checksums(sums, rest, len - ck);
+  finish_checksums(sums);
+
+  if(ck > 0)
   {
-    img->cmd_repeat += 1;
+    if((count = (ck - sizeof(struct checksum_tail)) / sizeof(uint32_t)) != sums->count)
+      err_exit("Delta has checksums for %lld blocks instead of %lld\n", (long long)count, (long long)sums->count);
+
+    for(i = 0; i < count; i++)
+    {
+      if(memcmp(rest + len - ck + i * sizeof(uint32_t), &sums->crcs[i], sizeof(uint32_t)) != 0)
+      {
+        fprintf(stderr, "Checksum mismatch in bytes %lld to %lld of the delta\n", 
+          (long long)i * CHECK_BLOCK, (long long)(i + 1 < count ? (i + 1) * CHECK_BLOCK : sums->pos) - 1);
+        bad++;
+      }
+    }
+    if(bad)
+      err_exit("%lld of %lld blocks of the delta are corrupt\n", (long long)bad, (long long)count);
   }
+
+  if(used && old_inuse == sle64_to_cpu(old.hdr.inuse) && inuse != sle64_to_cpu(delta.hdr.inuse))
+    err_exit("Delta does not fit %s, it leaves %lld clusters in use instead of %lld\n", 
+      file1, (long long)inuse, (long long)sle64_to_cpu(delta.hdr.inuse));
+
+  printf("%s: %lld clusters, %lld payloads, %s%s%s\n", file2, (long long)ccount, (long long)payloads, 
+    ck ? "checksums match" : "no checksums", used ? ", fits " : "", used ? file1 : "");
+}
+
+/* all the changed runs are counted, and --ranges is written */
+static void start_delta_stat()
+{
+  delta_stat.enabled = 1;
+  stats.enabled = 1;                                      /* for the counts of the commands         */
+  if(opt.ranges && (delta_stat.ranges = fopen(opt.ranges, "w")) == NULL)
+    perr_exit("failed to open the file of changed ranges");
+}
+
+/* of a delta of ccount clusters and bytes, made from only sampled clusters of them */
+static void print_delta_stat(char* name, int64_t ccount, uint64_t bytes, int64_t sampled)
+{
+  double scale = sampled > 0 ? (double)ccount / sampled : 1;
+  int i;
+
+  end_changed_run();
+  if(delta_stat.ranges && fclose(delta_stat.ranges) != 0)
+    perr_exit("failed to write the file of changed ranges");
+
+  printf("%s: %lld clusters, %lld changed (%.2f%%) in %lld runs, %llu bytes\n", name, (long long)ccount, 
+    (long long)delta_stat.changed, ccount > 0 ? 100.0 * delta_stat.changed / ccount : 0, 
+    (long long)delta_stat.runs, (unsigned long long)bytes);
+  if(sampled < ccount)
+    printf("estimated from %lld sampled clusters: %.0f changed (%.2f%%), %.0f bytes\n", (long long)sampled, 
+      delta_stat.changed * scale, sampled > 0 ? 100.0 * delta_stat.changed / sampled : 0, bytes * scale);
+
+  for(i = 0; i <= CMD_PATCH; i++)
+    if(cmd_runs[i] > 0)
+      printf("%-5s %lld runs, %lld clusters\n", cmd_names[i], (long long)cmd_runs[i], (long long)cmd_clusters[i]);
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+    if(delta_stat.histogram[i] > 0 && i == 0)
+      printf("runs of 1 cluster: %lld\n", (long long)delta_stat.histogram[i]);
+    else if(delta_stat.histogram[i] > 0)
+      printf("runs of %lld-%lld clusters: %lld\n", 1LL << i, (2LL << i) - 1, (long long)delta_stat.histogram[i]);
+}
+
+/* makes the delta from OLDFILE to NEWFILE only to count it */
+static void stat_images(char* file1, char* file2)
+{
+  int64_t i, sampled = 0;
+
+  start_delta_stat();
+  create_delta(file1, file2, NULL);
+
+  if(opt.sample > 1)
+    for(i = 0; i < changes.count; i++)
+      sampled += changes.ranges[i].count;
   else
+    sampled = delta_stat.pos;
+  print_delta_stat(file2, delta_stat.pos, stats.out_bytes, sampled);
+}
+
+/* counts the commands of an existing DELTA */
+static void stat_delta(char* file)
+{
+  struct input_image delta;
+  int64_t ccount, pos, n;
+  size_t len;
+
+  start_delta_stat();
+  open_input_image(file, &delta, DELTA_MAGIC);
+  ccount = delta.ccount + delta.bbs_present;
+
+  for(pos = 0; pos < ccount; pos += n)
   {
-    write_pending_cmd(img);
-    img->cmd = cmd;
-    img->cmd_repeat = 1;
+    read_next_cmd(&delta, 1);
+
+    n = 1;
+    if(delta.cmd == CMD_SKIP || delta.cmd == CMD_DROP || delta.cmd == CMD_ZERO)
+    {
+      n += delta.cmd_repeat;
+      delta.cmd_repeat = 0;
+      if(n > ccount - pos)
+        err_exit("Delta has %lld clusters beyond the end of the volume\n", (long long)(n - ccount + pos));
+    }
+    else if(delta.cmd == CMD_DATA)
+      skip_payload(&delta, delta.csize);
+    else if(delta.cmd == CMD_PATCH)
+      skip_payload(&delta, patch_size(delta.patch_map, delta.csize));
+
+    stats_command(delta.cmd, n);
+    stat_command(delta.cmd, n);
   }
+
+  read_rest(&delta, &len);                                /* the trailers count for the size        */
+  print_delta_stat(file, ccount, delta.map ? delta.map_size : delta.st->bytes, ccount);
 }
 
-static void write_data(struct output_image* img, char* cdata, uint32_t csize)
+/* 
+ * synthetic images for benchmarks, with the shape of the volume and of the
+ * changes between OLDFILE and NEWFILE set by --shape
+ */
+static struct
 {
-  write_pending_cmd(img);
+  uint32_t csize;
+  int64_t size;    /* of the volume in bytes */
+  double fill;     /* clusters in use in OLDFILE */
+  double change;   /* clusters changed, allocated or freed in NEWFILE */
+  double moved;    /* clusters of NEWFILE copied from elsewhere in OLDFILE */
+  double run;      /* mean length of the runs of used clusters */
+  double burst;    /* mean length of the runs of changed clusters */
+  uint64_t seed;
+}
+shape = { 4096, 1LL << 30, 0.5, 0.05, 0.01, 64, 8, 1 };
 
-  write_all(img->fd, &img->cmd, sizeof(img->cmd));
-  write_all(img->fd, cdata, csize);
+static uint64_t shape_random(uint64_t* state)
+{
+  return fmix64(*state += 0x9e3779b97f4a7c15ULL);
 }
 
-static void prepare_image_files(
-  char* file1, struct input_image* img1, char* magic1, 
-  char* file2, struct input_image* img2, char* magic2, 
-  char* file3, struct output_image* img3, char* magic3)
+/* uniform in [0, 1) */
+static double shape_uniform(uint64_t* state)
 {
-  open_input_image(file1, img1, magic1);
-  open_input_image(file2, img2, magic2);
+  return (shape_random(state) >> 11) * (1.0 / (1ULL << 53));
+}
 
-  if(memcmp(&img1->hdr.cluster_size, &img2->hdr.cluster_size, ((size_t)&((struct image_hdr*)0)->inuse) - IMAGE_MAGIC_SIZE - 2) != 0)
-    err_exit("Input images do not have identical headers\n");
-    
-  if(img1->hdr_extra_len && memcmp(img1->hdr_extra, img2->hdr_extra, img1->hdr_extra_len) != 0)
-    err_exit("Input images do not have identical headers\n");
-		
-  create_output_image(file3, img3, magic3, img2);
+/* uniform in [1, 2 * mean - 1], or 0 or 1 for a mean below 1 */
+static int64_t shape_run(uint64_t* state, double mean)
+{
+  if(mean < 1)
+    return shape_uniform(state) < mean;
+  return 1 + (int64_t)(shape_uniform(state) * (2 * mean - 1));
 }
 
-static void finish_image_files(struct input_image* img1, struct input_image* img2, struct output_image* img3)
+/* fills a cluster with the pseudo-random content selected by key */
+static void shape_fill(char* cdata, uint32_t len, uint64_t key)
 {
-  if(img1->cmd_repeat > 0)
-    err_exit("First input image has %d remaining unused clusters at the end\n", (int)img1->cmd_repeat);
+  uint64_t state = fmix64(shape.seed) ^ key, v;
+  uint32_t i;
 
-  if(img2->cmd_repeat > 0)
-    err_exit("Second input image has %d remaining unused clusters at the end\n", (int)img2->cmd_repeat);
+  for(i = 0; i < len; i += sizeof(v))
+  {
+    v = shape_random(&state);
+    memcpy(cdata + i, &v, sizeof(v));
+  }
+}
 
-  write_pending_cmd(img3);
-  fsync(img3->fd);
+/* the cluster at pos in OLDFILE, every 16th one on average all zero */
+static void shape_cluster(char* cdata, int64_t pos)
+{
+  if(fmix64(shape.seed ^ ~(uint64_t)pos) % 16 == 0)
+    memset(cdata, 0, shape.csize);
+  else
+    shape_fill(cdata, shape.csize, 2 * pos);
 }
-  
 
-static void create_delta(char* file1, char* file2, char* file3)
+static void generate_images(char* file1, char* file2)
 {
-  int64_t pos, ccount;
-  struct input_image old, new;
-  struct output_image delta;
-  
-  prepare_image_files(file1, &old, IMAGE_MAGIC, file2, &new, IMAGE_MAGIC, file3, &delta, DELTA_MAGIC);
+  static char ocluster[NTFS_MAX_CLUSTER_SIZE], ncluster[NTFS_MAX_CLUSTER_SIZE];
+  struct input_image hdr;
+  struct output_image old, new;
+  int64_t n = shape.size / shape.csize, pos, len, from, burst = 0, inuse[2] = { 0, 0 };
+  uint64_t state = shape.seed;
+  uint8_t* used;
+  int in_use, was, now, i;
+  double u;
 
-  ccount = old.ccount;                                    /* if both files have the new format with */
-  if(old.bbs_present == 1 && new.bbs_present == 1)        /* the backup boot sector at the end, we  */
-    ccount += 1;                                          /* just have one block more to compare    */
+  if(n < 1)
+    err_exit("The synthetic volume has no clusters\n");
+  if((used = calloc(n / 8 + 1, 1)) == NULL)
+    perr_exit("failed to allocate cluster bitmap");
+
+  for(pos = 0, in_use = 1; pos < n && shape.fill > 0; pos += len, in_use = !in_use)
+  {                                                       /* alternating runs of used and unused    */
+    len = shape_run(&state, in_use ? shape.run : shape.run * (1 - shape.fill) / shape.fill);
+    for(i = 0; in_use && i < len && pos + i < n; i++)
+      used[(pos + i) >> 3] |= 1 << ((pos + i) & 7);
+  }
 
-  for(pos = 0; pos < ccount; pos++)
+  memset(&hdr, 0, sizeof(hdr));                           /* what ntfsclone writes for a volume of  */
+  hdr.hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR;            /* this size                              */
+  hdr.hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR_NEW;
+  hdr.hdr.cluster_size = cpu_to_le32(shape.csize);
+  hdr.hdr.device_size = cpu_to_sle64(n * shape.csize + NTFS_SECTOR_SIZE);
+  hdr.hdr.nr_clusters = cpu_to_sle64(n);
+  hdr.hdr.offset_to_image_data = cpu_to_le32(sizeof(hdr.hdr));
+  hdr.ccount = n;
+  hdr.bbs_present = 1;
+
+  create_output_image(file1, &old, IMAGE_MAGIC, &hdr);
+  create_output_image(file2, &new, IMAGE_MAGIC, &hdr);
+  if(!old.seekable || !new.seekable)
+    err_exit("Synthetic images can only be written to regular files\n");
+
+  for(pos = 0; pos < n; pos++)
   {
-    read_next_cluster(&old, 0);
-    read_next_cluster(&new, 0);
+    was = now = (used[pos >> 3] >> (pos & 7)) & 1;
+    if(was)
+    {
+      shape_cluster(ocluster, pos);
+      memcpy(ncluster, ocluster, shape.csize);
+    }
+
+    if(burst == 0 && shape_uniform(&state) < shape.change / shape.burst)
+      burst = shape_run(&state, shape.burst);
+
+    u = shape_uniform(&state);
+    if(burst > 0)
+    {
+      burst--;
+      if(!was || u >= 0.6)                                /* newly allocated or rewritten           */
+      {
+        now = 1;
+        shape_fill(ncluster, shape.csize, 2 * pos + 1);
+      }
+      else if(u < 0.1)                                    /* freed                                  */
+        now = 0;
+      else if(u < 0.2)
+        memset(ncluster, 0, shape.csize);
+      else                                                /* a single sector written                */
+        shape_fill(ncluster + shape_random(&state) % (shape.csize / NTFS_SECTOR_SIZE) * NTFS_SECTOR_SIZE,
+          NTFS_SECTOR_SIZE, 2 * pos + 1);
+    }
+    else if(was && u < shape.moved)
+    {
+      for(i = 0; i < 16; i++)                             /* a used cluster from anywhere in OLDFILE */
+      {
+        from = shape_random(&state) % n;
+        if((used[from >> 3] >> (from & 7)) & 1)
+        {
+          shape_cluster(ncluster, from);
+          break;
+        }
+      }
+    }
 
-    if((old.cmd == new.cmd) && (old.cmd == CMD_SKIP || memcmp(old.cdata, new.cdata, old.csize) == 0)) 
-      write_cmd(&delta, CMD_SKIP);
-    else if(new.cmd == CMD_SKIP)
-      write_cmd(&delta, CMD_DROP);
+    if(was)
+      write_data(&old, ocluster, shape.csize);
     else
-      write_data(&delta, new.cdata, new.csize);
-  }
-  
-  if(old.bbs_present == 1 && new.bbs_present == 0)        /* if only the first file has the new     */
-  {                                                       /* format with the backup boot sector at  */
-    read_next_cluster(&old, 0);                           /* the end, we just discard this block    */
+      write_cmd(&old, CMD_SKIP, 1);
+
+    if(now)
+      write_data(&new, ncluster, shape.csize);
+    else
+      write_cmd(&new, CMD_SKIP, 1);
+
+    inuse[0] += was;
+    inuse[1] += now;
   }
-  else if(old.bbs_present == 0 && new.bbs_present == 1)   /* if only the second file has the new    */
-  {                                                       /* format with the backup boot sector at  */
-    read_next_cluster(&new, 0);                           /* the end, we have to keep this block    */
-    write_data(&delta, new.cdata, new.csize);
+
+  memset(ocluster, 0, shape.csize);                       /* the backup boot sector                 */
+  shape_fill(ocluster, NTFS_SECTOR_SIZE, ~(uint64_t)0);
+  write_data(&old, ocluster, shape.csize);
+  write_data(&new, ocluster, shape.csize);
+
+  write_pending_cmd(&old);
+  write_pending_cmd(&new);
+  flush_output(&old);
+  flush_output(&new);
+
+  inuse[0] = cpu_to_sle64(inuse[0]);                      /* only known now                         */
+  inuse[1] = cpu_to_sle64(inuse[1]);
+  pwrite_all(old.fd, &inuse[0], sizeof(inuse[0]), offsetof(struct image_hdr, inuse));
+  pwrite_all(new.fd, &inuse[1], sizeof(inuse[1]), offsetof(struct image_hdr, inuse));
+  close(old.fd);
+  close(new.fd);
+  free(used);
+}
+
+/* copies file to the pipe fd from a child process */
+static void bench_feed(char* file, int* fds)
+{
+  char buf[1 << 16];
+  ssize_t n;
+  int fd;
+
+  switch(fork())
+  {
+    case -1:
+      perr_exit("fork failed");
+      break;
+    case 0:
+      close(fds[0]);
+      if((fd = open(file, O_RDONLY)) == -1)
+        perr_exit("failed to open input image");
+      while((n = read(fd, buf, sizeof(buf))) > 0)
+        write_all(fds[1], buf, n);
+      _exit(n < 0);
   }
-  
-  finish_image_files(&old, &new, &delta);
+  close(fds[1]);
 }
 
-static void apply_patch(char *file1, char* file2, char* file3)
+static const char* bench_modes[] = { "mmap", "no-mmap", "pipe", "io_uring" };
+
+/* 
+ * runs a delta or patch in a child process, in the pipe mode with its 
+ * second file read from stdin, and returns the time it took in ns or -1
+ * if it failed, e.g. for options that need mmap
+ */
+static int64_t bench_run(char* command, int mode, int threads, char* file1, char* file2, char* file3)
 {
-  int64_t pos, ccount;
-  struct input_image old, delta;
-  struct output_image new;
-  
-  prepare_image_files(file1, &old, IMAGE_MAGIC, file2, &delta, DELTA_MAGIC, file3, &new, IMAGE_MAGIC);
-  
-  ccount = old.ccount;                                    /* if both files have the new format with */
-  if(old.bbs_present == 1 && delta.bbs_present == 1)      /* the backup boot sector at the end, we  */
-    ccount += 1;                                          /* just have one block more to compare    */
+  struct timespec start, end;
+  int status, fds[2];
+  pid_t pid;
 
-  for(pos = 0; pos < ccount; pos++)
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if((pid = fork()) == -1)
+    perr_exit("fork failed");
+  if(pid == 0)
   {
-    read_next_cluster(&old, 0);
-    read_next_cluster(&delta, 1);
+    opt.no_mmap = mode == 1 || mode == 3;
+    opt.io_uring = mode == 3;
+    opt.threads = threads;
+    if(mode == 2)
+    {
+      if(pipe(fds) == -1)
+        perr_exit("pipe failed");
+      bench_feed(file2, fds);
+      if(dup2(fds[0], STDIN_FILENO) == -1)
+        perr_exit("dup2 failed");
+      file2 = "-";
+    }
 
-    if(delta.cmd == CMD_DROP || (old.cmd == CMD_SKIP && delta.cmd == CMD_SKIP))
-      write_cmd(&new, CMD_SKIP);
-    else if(delta.cmd == CMD_SKIP)
-      write_data(&new, old.cdata, old.csize);
-    else 
-      write_data(&new, delta.cdata, delta.csize);
+    memset(&stats, 0, sizeof(stats));                     /* the counters of this run alone         */
+    memset(cmd_runs, 0, sizeof(cmd_runs));
+    memset(cmd_clusters, 0, sizeof(cmd_clusters));
+    stats.enabled = opt.stats || opt.progress;
+    stats.start = stats.last_print = stats_clock();
+
+    if(strcmp(command, "delta") == 0)
+      create_delta(file1, file2, file3);
+    else
+      apply_patch(file1, &file2, 1, file3);
+    finish_stats(command);
+    while(wait(NULL) > 0)                                 /* the feeder of the pipe                 */
+      ;
+    exit(0);
   }
-  
-  if(old.bbs_present == 1 && delta.bbs_present == 0)      /* if only the first file has the new     */
-  {                                                       /* format with the backup boot sector at  */
-    read_next_cluster(&old, 0);                           /* the end, we just discard this block    */
+
+  if(waitpid(pid, &status, 0) == -1)
+    perr_exit("waitpid failed");
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * NSEC + end.tv_nsec - start.tv_nsec;
+}
+
+static void bench_compare(char* file1, char* file2)
+{
+  static char buf1[1 << 16], buf2[1 << 16];
+  int fd1, fd2;
+  ssize_t n;
+
+  if((fd1 = open(file1, O_RDONLY)) == -1 || (fd2 = open(file2, O_RDONLY)) == -1)
+    perr_exit("failed to open image");
+
+  do
+  {
+    if((n = read(fd1, buf1, sizeof(buf1))) < 0 || read(fd2, buf2, n ? n : 1) != n)
+      err_exit("Patched image %s differs in size from %s\n", file2, file1);
+    if(memcmp(buf1, buf2, n) != 0)
+      err_exit("Patched image %s differs from %s\n", file2, file1);
   }
-  else if(old.bbs_present == 0 && delta.bbs_present == 1) /* if only the second file has the new    */
-  {                                                       /* format with the backup boot sector at  */
-    read_next_cluster(&delta, 0);                         /* the end, we have to keep this block    */
-    write_data(&new, delta.cdata, delta.csize);
+  while(n > 0);
+
+  close(fd1);
+  close(fd2);
+}
+
+/* 
+ * generates a pair of images in dir and times their delta and its patch
+ * for every I/O mode and number of threads up to the number of CPUs
+ */
+static void bench_images(char* dir)
+{
+  char file[4][4096];
+  static const char* names[] = { "bench-old.img", "bench-new.img", "bench.delta", "bench-patched.img" };
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int64_t delta_ns, patch_ns;
+  struct stat st[2];
+  int i, mode, threads;
+
+  for(i = 0; i < 4; i++)
+    snprintf(file[i], sizeof(file[i]), "%s/%s", dir, names[i]);
+
+  generate_images(file[0], file[1]);
+  if(stat(file[1], &st[0]) == -1)
+    perr_exit("stat failed");
+
+  printf("%lld clusters of %u bytes, %.0f%% in use, %.1f%% changed, %.1f%% moved, NEWFILE %lld bytes\n",
+    (long long)(shape.size / shape.csize), shape.csize, shape.fill * 100, shape.change * 100, shape.moved * 100,
+    (long long)st[0].st_size);
+  printf("%-8s %7s %9s %9s %9s %9s %14s\n", "mode", "threads", "delta s", "MB/s", "patch s", "MB/s", "DELTA bytes");
+
+  for(mode = 0; mode < (int)(sizeof(bench_modes) / sizeof(*bench_modes)); mode++)
+  {
+    for(threads = 1; ; threads = threads * 2 < cpus ? threads * 2 : cpus)
+    {
+      if((delta_ns = bench_run("delta", mode, threads, file[0], file[1], file[2])) < 0 ||
+         (patch_ns = bench_run("patch", mode, threads, file[0], file[2], file[3])) < 0)
+        printf("%-8s %7d %9s\n", bench_modes[mode], threads, "failed");
+      else
+      {
+        bench_compare(file[1], file[3]);
+        if(stat(file[2], &st[1]) == -1)
+          perr_exit("stat failed");
+
+        printf("%-8s %7d %9.3f %9.1f %9.3f %9.1f %14lld\n", bench_modes[mode], threads, 
+          (double)delta_ns / NSEC, mb_per_second(st[0].st_size, delta_ns), 
+          (double)patch_ns / NSEC, mb_per_second(st[0].st_size, patch_ns), (long long)st[1].st_size);
+      }
+
+      unlink(file[2]);
+      unlink(file[3]);
+      if(threads >= cpus)
+        break;
+    }
   }
-  
-  finish_image_files(&old, &delta, &new);
+
+  unlink(file[0]);
+  unlink(file[1]);
 }
 
 static void usage()
 {
   err_exit(
-    "Usage: ntfscloneimgdelta delta OLDFILE [NEWFILE [DELTA]]\n"
-    "       ntfscloneimgdelta patch OLDFILE [DELTA [NEWFILE]]\n");
+    "Usage: ntfscloneimgdelta [OPTIONS] delta OLDFILE [NEWFILE [DELTA]]\n"
+    "       ntfscloneimgdelta [OPTIONS] delta --index INDEX [NEWFILE [DELTA]]\n"
+    "       ntfscloneimgdelta [OPTIONS] delta OLDFILE --from-device DEVICE [DELTA]\n"
+    "       ntfscloneimgdelta [OPTIONS] patch OLDFILE [DELTA [NEWFILE]]\n"
+    "       ntfscloneimgdelta [OPTIONS] patch OLDFILE DELTA1 DELTA2 [...] NEWFILE\n"
+    "       ntfscloneimgdelta [OPTIONS] batch OLDFILE NEWFILE1 DELTA1 [NEWFILE2 DELTA2 [...]]\n"
+    "       ntfscloneimgdelta [OPTIONS] batch --index INDEX NEWFILE1 DELTA1 [...]\n"
+    "       ntfscloneimgdelta [OPTIONS] index OLDFILE [INDEX]\n"
+    "       ntfscloneimgdelta [OPTIONS] merge DELTA1 DELTA2 [...] MERGED\n"
+    "       ntfscloneimgdelta [OPTIONS] rebase OLDFILE NEWFILE REVERSE < NEWFILE\n"
+    "       ntfscloneimgdelta [OPTIONS] verify [OLDFILE] DELTA\n"
+    "       ntfscloneimgdelta [OPTIONS] verify --index INDEX [DELTA]\n"
+    "       ntfscloneimgdelta [OPTIONS] stat OLDFILE NEWFILE\n"
+    "       ntfscloneimgdelta [OPTIONS] stat --index INDEX [NEWFILE]\n"
+    "       ntfscloneimgdelta [OPTIONS] stat DELTA\n"
+    "       ntfscloneimgdelta [OPTIONS] mount OLDFILE [DELTA1 [...]] MOUNTPOINT\n"
+    "       ntfscloneimgdelta [OPTIONS] generate OLDFILE NEWFILE\n"
+    "       ntfscloneimgdelta [OPTIONS] bench DIR\n"
+    "\n"
+    "Options:\n"
+    "  -b, --buffer-size SIZE   I/O buffer per image file (default 8M)\n"
+    "      --no-mmap            do not map input files into memory\n"
+    "      --io-uring           read and write the files through io_uring with\n"
+    "                           many requests in flight, instead of mapping them\n"
+    "  -t, --threads N          use N worker threads; batch is single-threaded\n"
+    "                           and only compresses in them, with -z\n"
+    "      --memory-limit SIZE  at most SIZE for the clusters in flight between\n"
+    "                           the threads, if the images are not mapped\n"
+    "  -i, --index INDEX        compare against the cluster hashes in INDEX\n"
+    "  -m, --moves              look for clusters moved within OLDFILE\n"
+    "  -d, --dedup              refer back to identical clusters within DELTA\n"
+    "  -z, --compress[=LEVEL]   compress the payloads of DELTA (zlib, default 1)\n"
+    "  -0, --zeros              write changed all-zero clusters without payload\n"
+    "  -x, --seek-index[=N]     end DELTA with an offset for every N clusters\n"
+    "                           (default 64k)\n"
+    "  -s, --sectors            write only the changed sectors of partly\n"
+    "                           changed clusters\n"
+    "      --checksums          end DELTA with the crc32 of every 1M of it,\n"
+    "                           for verify\n"
+    "      --stats[=JSON]       print throughput, waiting times and counts of\n"
+    "                           the commands written at the end, and write\n"
+    "                           them to the file JSON\n"
+    "      --progress           print the progress every second\n"
+    "  -r, --raw                patch to the raw volume, NEWFILE is a block\n"
+    "                           device or a sparse file\n"
+    "      --direct             write the raw volume with O_DIRECT\n"
+    "      --resume FILE        record checkpoints of delta or patch in FILE,\n"
+    "                           and go on from the last one if there is one\n"
+    "      --from-device DEVICE read NEWFILE from the unmounted NTFS volume\n"
+    "                           DEVICE, only its clusters in use\n"
+    "      --changed LIST       compare only the clusters in LIST, with a line\n"
+    "                           \"FIRST COUNT\" for each range of them\n"
+    "      --changed-bitmap MAP compare only the clusters set in MAP, a bit\n"
+    "                           for each cluster\n"
+    "      --sample N           stat compares only one in N runs of 1024\n"
+    "                           clusters, and estimates the rest from them\n"
+    "      --ranges FILE        stat writes the changed ranges to FILE, in\n"
+    "                           the format of --changed\n"
+    "      --shape SPEC         shape of the synthetic images of generate and\n"
+    "                           bench, a list of size=1g, csize=4k, fill=0.5,\n"
+    "                           change=0.05, moved=0.01, run=64, burst=8 and\n"
+    "                           seed=1 with the default values\n");
+}
+
+static size_t parse_size(const char* arg)
+{
+  char* end;
+  unsigned long long size = strtoull(arg, &end, 10);
+
+  switch(*end)
+  {
+    case 'g': case 'G': size <<= 10; /* fall through */
+    case 'm': case 'M': size <<= 10; /* fall through */
+    case 'k': case 'K': size <<= 10; end++;
+  }
+
+  if(end == arg || *end != '\0')
+    err_exit("Invalid size: %s\n", arg);
+
+  return (size_t)size;
+}
+
+static double parse_ratio(const char* arg)
+{
+  char* end;
+  double ratio = strtod(arg, &end);
+
+  if(end == arg || *end != '\0' || ratio < 0 || ratio > 1)
+    err_exit("Invalid ratio: %s\n", arg);
+
+  return ratio;
+}
+
+/* a comma separated list of key=value */
+static void parse_shape(char* arg)
+{
+  char* key, * value, * save = NULL;
+
+  for(key = strtok_r(arg, ",", &save); key; key = strtok_r(NULL, ",", &save))
+  {
+    if((value = strchr(key, '=')) == NULL)
+      err_exit("Invalid shape: %s\n", key);
+    *value++ = '\0';
+
+    if(strcmp(key, "size") == 0)
+      shape.size = parse_size(value);
+    else if(strcmp(key, "csize") == 0)
+      shape.csize = parse_size(value);
+    else if(strcmp(key, "fill") == 0)
+      shape.fill = parse_ratio(value);
+    else if(strcmp(key, "change") == 0)
+      shape.change = parse_ratio(value);
+    else if(strcmp(key, "moved") == 0)
+      shape.moved = parse_ratio(value);
+    else if(strcmp(key, "run") == 0)
+      shape.run = parse_size(value);
+    else if(strcmp(key, "burst") == 0)
+      shape.burst = parse_size(value);
+    else if(strcmp(key, "seed") == 0)
+      shape.seed = strtoull(value, NULL, 0);
+    else
+      err_exit("Unknown shape: %s\n", key);
+  }
+
+  if(shape.csize < NTFS_SECTOR_SIZE || shape.csize > NTFS_MAX_CLUSTER_SIZE || (shape.csize & (shape.csize - 1)))
+    err_exit("Invalid cluster size: %u\n", shape.csize);
+  if(shape.run < 1 || shape.burst < 1)
+    err_exit("Invalid run length\n");
 }
 
 int main(int argc, char** argv)
 {
+  static const struct option long_opts[] = 
+  {
+    { "buffer-size", required_argument, NULL, 'b' },
+    { "no-mmap", no_argument, NULL, 'M' },
+    { "io-uring", no_argument, NULL, 'U' },
+    { "raw", no_argument, NULL, 'r' },
+    { "direct", no_argument, NULL, 'D' },
+    { "from-device", required_argument, NULL, 'F' },
+    { "changed", required_argument, NULL, 'C' },
+    { "changed-bitmap", required_argument, NULL, 'B' },
+    { "threads", required_argument, NULL, 't' },
+    { "index", required_argument, NULL, 'i' },
+    { "moves", no_argument, NULL, 'm' },
+    { "dedup", no_argument, NULL, 'd' },
+    { "compress", optional_argument, NULL, 'z' },
+    { "zeros", no_argument, NULL, '0' },
+    { "seek-index", optional_argument, NULL, 'x' },
+    { "sectors", no_argument, NULL, 's' },
+    { "checksums", no_argument, NULL, 'K' },
+    { "stats", optional_argument, NULL, 'S' },
+    { "progress", no_argument, NULL, 'P' },
+    { "shape", required_argument, NULL, 'H' },
+    { "sample", required_argument, NULL, 'A' },
+    { "ranges", required_argument, NULL, 'R' },
+    { "memory-limit", required_argument, NULL, 'L' },
+    { "resume", required_argument, NULL, 'W' },
+    { NULL, 0, NULL, 0 }
+  };
   char* file1, * file2, * file3;
+  int c;
 
-  if(argc < 3)
+  while((c = getopt_long(argc, argv, "b:t:i:mdz::0x::rs", long_opts, NULL)) != -1)
+  {
+    switch(c)
+    {
+      case 'b':
+        opt.buffer_size = parse_size(optarg);
+        if(opt.buffer_size < MIN_BUFFER_SIZE)
+          opt.buffer_size = MIN_BUFFER_SIZE;
+        break;
+      case 'M':
+        opt.no_mmap = 1;
+        break;
+      case 'U':
+        opt.io_uring = 1;
+        opt.no_mmap = 1;
+        break;
+      case 'r':
+        opt.raw = 1;
+        break;
+      case 'D':
+        opt.direct = 1;
+        break;
+      case 'F':
+        opt.device = optarg;
+        break;
+      case 'C':
+      case 'B':
+        opt.changed = optarg;
+        opt.changed_bitmap = c == 'B';
+        break;
+      case 't':
+        if((opt.threads = atoi(optarg)) < 1)
+          err_exit("Invalid number of threads: %s\n", optarg);
+        break;
+      case 'i':
+        opt.index = optarg;
+        break;
+      case 'm':
+        opt.moves = 1;
+        break;
+      case 'd':
+        opt.dedup = 1;
+        break;
+      case 'z':
+        opt.compress = optarg ? atoi(optarg) : Z_BEST_SPEED;
+        if(opt.compress < 0 || opt.compress > 9)
+          err_exit("Invalid compression level: %s\n", optarg);
+        break;
+      case '0':
+        opt.zeros = 1;
+        break;
+      case 's':
+        opt.sectors = 1;
+        break;
+      case 'K':
+        opt.checksums = 1;
+        break;
+      case 'S':
+        opt.stats = 1;
+        opt.stats_json = optarg;
+        break;
+      case 'P':
+        opt.progress = 1;
+        break;
+      case 'H':
+        parse_shape(optarg);
+        break;
+      case 'A':
+        if((opt.sample = atoll(optarg)) < 1)
+          err_exit("Invalid sample rate: %s\n", optarg);
+        break;
+      case 'R':
+        opt.ranges = optarg;
+        break;
+      case 'L':
+        opt.memory_limit = parse_size(optarg);
+        break;
+      case 'W':
+        opt.resume = optarg;
+        break;
+      case 'x':
+        if((opt.seek_step = optarg ? (int64_t)parse_size(optarg) : SEEK_STEP) < 1)
+          err_exit("Invalid seek index step: %s\n", optarg);
+        break;
+      default:
+        usage();
+    }
+  }
+
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if(argc < 2 || (!opt.index && argc < 3) || 
+     ((opt.device || opt.changed) && strcmp(argv[1], "delta") != 0 && strcmp(argv[1], "stat") != 0) ||
+     (opt.index && strcmp(argv[1], "delta") != 0 && strcmp(argv[1], "verify") != 0 && strcmp(argv[1], "stat") != 0 &&
+      strcmp(argv[1], "batch") != 0) ||
+     ((opt.sample || opt.ranges) && strcmp(argv[1], "stat") != 0) ||
+     (opt.resume && strcmp(argv[1], "delta") != 0 && strcmp(argv[1], "patch") != 0))
     usage();
-    
-  file1 = argv[2];
-  file2 = argc > 3 ? argv[3] : "-";
-  file3 = argc > 4 ? argv[4] : "-";
+
+  if(opt.index && opt.sectors)
+    err_exit("Changed sectors cannot be found with an index\n");
+
+  c = 2;                                                  /* an index takes the place of OLDFILE,   */
+  file1 = opt.index ? opt.index : argv[c++];              /* and a device that of NEWFILE           */
+  file2 = opt.device ? opt.device : (argc > c ? argv[c++] : "-");
+  file3 = argc > c ? argv[c++] : "-";
+
+  init_clusters_equal();
+  stats.enabled = opt.stats || opt.progress;
+  stats.start = stats.last_print = stats_clock();
+
+  if(strcmp(argv[1], "index") == 0)
+  {
+    create_index(file1, file2);
+    finish_stats(argv[1]);
+    return 0;
+  }
+
+  if(strcmp(argv[1], "mount") == 0)
+  {
+    if(argc < 4)
+      usage();
+    mount_volume(argv[2], argv + 3, argc - 4, argv[argc - 1]);
+    return 0;
+  }
+
+  if(strcmp(argv[1], "rebase") == 0)
+  {
+    if(argc != 5)
+      usage();
+    rebase_image(argv[2], argv[3], argv[4]);
+    finish_stats(argv[1]);
+    return 0;
+  }
+
+  if(strcmp(argv[1], "verify") == 0)
+  {
+    if(opt.index)                                         /* just like for delta                    */
+      verify_delta(file1, file2);
+    else if(argc < 5)
+      verify_delta(argc == 4 ? argv[2] : NULL, argv[argc - 1]);
+    else
+      usage();
+    finish_stats(argv[1]);
+    return 0;
+  }
+
+  if(strcmp(argv[1], "merge") == 0)
+  {
+    if(argc < 5)
+      usage();
+    merge_deltas(argv + 2, argc - 3, argv[argc - 1]);
+    finish_stats(argv[1]);
+    return 0;
+  }
   
+  if(strcmp(argv[1], "generate") == 0)
+  {
+    if(argc < 4)
+      usage();
+    generate_images(file1, file2);
+    return 0;
+  }
+
+  if(strcmp(argv[1], "bench") == 0)
+  {
+    bench_images(argv[2]);
+    return 0;
+  }
+
+  if(strcmp(argv[1], "batch") == 0)
+  {
+    c = opt.index ? 2 : 3;                                /* NEWFILE and DELTA pairs after OLDFILE  */
+    if(argc < c + 2 || (argc - c) % 2 != 0)
+      usage();
+    create_batch(file1, argv + c, (argc - c) / 2);
+    finish_stats(argv[1]);
+    return 0;
+  }
+
+  if(strcmp(argv[1], "stat") == 0)
+  {
+    if(opt.sample > 1 && opt.changed)
+      err_exit("--sample cannot be combined with --changed\n");
+    if(argc == 3 && !opt.index && !opt.device)            /* an existing DELTA                      */
+    {
+      if(opt.sample > 1 || opt.changed)
+        usage();
+      stat_delta(argv[2]);
+    }
+    else if(argc == 4 || opt.index || opt.device)
+    {
+      if(strcmp(file1, "-") == 0 && strcmp(file2, "-") == 0)
+        err_exit("You cannot select stdin for both input files\n");
+      stat_images(file1, file2);
+    }
+    else
+      usage();
+    finish_stats(argv[1]);
+    return 0;
+  }
+
   if(strcmp(file1, "-") == 0 && strcmp(file2, "-") == 0)
     err_exit("You cannot select stdin for both input files\n");
 
   if(strcmp(argv[1], "delta") == 0)
     create_delta(file1, file2, file3);
   else if(strcmp(argv[1], "patch") == 0)
-    apply_patch(file1, file2, file3);
+  {
+    if(argc > 5)                                          /* a chain of deltas, NEWFILE is last     */
+      apply_patch(file1, argv + 3, argc - 4, argv[argc - 1]);
+    else
+      apply_patch(file1, &file2, 1, file3);
+  }
   else
     usage();
-    
+
+  finish_stats(argv[1]);
   return 0;
 }